@@ -0,0 +1,233 @@
+//
+// bench.c
+// Throughput benchmarks for yajl_sparkling.c
+//
+// Build and run using
+//
+//     make bench && ./bench/bench
+//
+// The module source is included directly, so that its internal entry
+// points can be timed against each other on the same input.
+//
+
+#include "../yajl_sparkling.c"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_RUNS 5
+#define BENCH_NUMBERS 1000000
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// An array of small records, roughly 'size' bytes long
+static char *make_records(size_t size, size_t *length)
+{
+	char *json = malloc(size + 256);
+	size_t n = 0;
+
+	if (json == NULL) {
+		return NULL;
+	}
+
+	json[n++] = '[';
+
+	for (long i = 0; n < size; i++) {
+		n += sprintf(
+			json + n,
+			"%s{\"id\":%ld,\"name\":\"user %ld\",\"tags\":[\"a\",\"b\\n\"],"
+			"\"score\":%.2f,\"active\":true,\"note\":null}",
+			i ? "," : "",
+			i,
+			i,
+			i * 0.25
+		);
+	}
+
+	json[n++] = ']';
+	json[n] = 0;
+
+	*length = n;
+	return json;
+}
+
+static const char *classifier_name(void)
+{
+	pthread_once(&classify_once, classify_select);
+
+#ifdef INDEX_AVX2
+	if (classify_block == classify_avx2) {
+		return "AVX2";
+	}
+#endif
+
+#ifdef __SSE2__
+	if (classify_block == classify_sse2) {
+		return "SSE2";
+	}
+#endif
+
+	return "generic";
+}
+
+// Best throughput in MB/s over BENCH_RUNS parses, either by YAJL or
+// through the structural index
+static double bench_parse(const char *json, size_t length, int indexed, SpnContext *ctx)
+{
+	ParserOptions options = default_parser_options();
+	double best = 0;
+
+	for (int i = 0; i < BENCH_RUNS; i++) {
+		PooledParser *parser = parser_acquire(&options);
+		SpnValue ret = spn_nilval;
+		const unsigned char *str = (const unsigned char *)(json);
+
+		double start = now();
+		int rv = indexed
+		       ? parse_indexed(parser, &options, str, length, &ret, ctx)
+		       : parse_serial(parser, str, length, &ret, ctx);
+		double elapsed = now() - start;
+
+		parser_release(parser, rv == 0);
+		spn_value_release(&ret);
+
+		if (rv != 0) {
+			fprintf(stderr, "parse failed\n");
+			return 0;
+		}
+
+		double mbps = length / elapsed / 1e6;
+
+		if (mbps > best) {
+			best = mbps;
+		}
+	}
+
+	return best;
+}
+
+// A fixed sequence of pseudo-random numbers, so that runs are comparable
+static uint64_t random_next(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+// Metric-style values (a few significant digits) and arbitrary doubles
+static double *make_doubles(size_t n)
+{
+	double *values = malloc(n * sizeof values[0]);
+	uint64_t state = 0x9e3779b97f4a7c15;
+
+	if (values == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t r = random_next(&state);
+
+		if (i % 2 == 0) {
+			values[i] = (double)(r % 1000000) / 1000.0;
+		} else {
+			memcpy(&values[i], &r, sizeof values[i]);
+
+			if (!isfinite(values[i])) {
+				values[i] = (double)(r >> 11) * 0x1p-53;
+			}
+		}
+	}
+
+	return values;
+}
+
+// Best time per number in nanoseconds over BENCH_RUNS passes, either
+// with format_double() or with "%.17g" (which yajl_gen_double() uses).
+// '*bytes' is set to the total length of the output.
+static double bench_format(const double *values, size_t n, int grisu, size_t *bytes)
+{
+	char buf[DTOA_BUFFER_SIZE];
+	double best = 0;
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		size_t total = 0;
+		double start = now();
+
+		for (size_t i = 0; i < n; i++) {
+			if (grisu) {
+				total += format_double(values[i], buf);
+			} else {
+				total += snprintf(buf, sizeof buf, "%.17g", values[i]);
+			}
+		}
+
+		double ns = (now() - start) * 1e9 / n;
+
+		if (run == 0 || ns < best) {
+			best = ns;
+		}
+
+		*bytes = total;
+	}
+
+	return best;
+}
+
+// Number of values which format_double() doesn't round-trip
+static size_t check_format(const double *values, size_t n)
+{
+	char buf[DTOA_BUFFER_SIZE + 1];
+	size_t bad = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		buf[format_double(values[i], buf)] = 0;
+		bad += strtod(buf, NULL) != values[i];
+	}
+
+	return bad;
+}
+
+int main(void)
+{
+	SpnContext *ctx = spn_ctx_new();
+	size_t length;
+	char *json = make_records(32 * 1024 * 1024, &length);
+
+	if (json == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	printf("parse, %zu bytes of records:\n", length);
+	printf("  YAJL:                %8.1f MB/s\n", bench_parse(json, length, 0, ctx));
+	printf("  structural index:    %8.1f MB/s (%s)\n", bench_parse(json, length, 1, ctx), classifier_name());
+
+	free(json);
+
+	double *values = make_doubles(BENCH_NUMBERS);
+
+	if (values == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	size_t grisu_bytes, printf_bytes;
+	double grisu_ns = bench_format(values, BENCH_NUMBERS, 1, &grisu_bytes);
+	double printf_ns = bench_format(values, BENCH_NUMBERS, 0, &printf_bytes);
+
+	printf("format, %d doubles:\n", BENCH_NUMBERS);
+	printf("  %%.17g:               %8.1f ns/number, %zu bytes\n", printf_ns, printf_bytes);
+	printf("  Grisu2:              %8.1f ns/number, %zu bytes\n", grisu_ns, grisu_bytes);
+	printf("  not round-tripping:  %zu\n", check_format(values, BENCH_NUMBERS));
+
+	free(values);
+	spn_ctx_free(ctx);
+
+	return 0;
+}
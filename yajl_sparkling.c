@@ -8,7 +8,36 @@
 // Licensed under the 2-clause BSD License
 //
 
+// With -std=c99, glibc only declares POSIX functions on request (and
+// realpath() only with the X/Open extensions). On macOS, requesting them
+// would hide everything else instead.
+#if !defined(__APPLE__) && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 code is compiled for a target attribute and picked at run time
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define INDEX_AVX2 1
+#endif
 
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
@@ -23,447 +52,6579 @@ static const SpnValue null_value = {
 };
 
 
-// parser state
+// Caches that are reused across calls (parser and generator pools, the
+// key cache, scratch arenas) are per thread: Sparkling contexts may run
+// on different threads, and Sparkling values can't be shared between
+// them. A thread's caches are freed by thread_cache_free() when it exits.
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL __thread
+#endif
 
-typedef struct StackNode {
-	SpnValue key; // for maps only
-	SpnValue value;
-	struct StackNode *next;
-} StackNode;
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+static int thread_cache_key_created;
+static THREAD_LOCAL int thread_cache_used;
 
-typedef struct ParserState {
-	SpnValue root;
-	StackNode *stack;
-	int explicit_null;
-} ParserState;
+static void thread_cache_free(void *unused);
 
-static ParserState state_init()
+static void thread_cache_create_key(void)
 {
-	return (ParserState) { .root = spn_nilval, .stack = NULL, .explicit_null = 0 };
+	thread_cache_key_created = pthread_key_create(&thread_cache_key, thread_cache_free) == 0;
 }
 
-static void state_free(ParserState *state)
+// Must be called before the calling thread touches its caches
+static void thread_cache_register(void)
 {
-	StackNode *head = state->stack;
-
-	while (head) {
-		StackNode *next = head->next;
-		spn_value_release(&head->key);
-		spn_value_release(&head->value);
-		free(head);
-		head = next;
+	if (!thread_cache_used) {
+		pthread_once(&thread_cache_once, thread_cache_create_key);
+		pthread_setspecific(thread_cache_key, &thread_cache_used);
+		thread_cache_used = 1;
 	}
 }
 
-static void state_push(ParserState *state, SpnValue collection)
-{
-	assert(spn_isarray(&collection) || spn_ishashmap(&collection));
 
-	StackNode *node = malloc(sizeof *node);
-	node->key = spn_nilval;
-	node->value = collection;
-	node->next = state->stack;
-	state->stack = node;
-}
+// Bump allocator handed to YAJL through yajl_alloc_funcs.
+// Small blocks are carved out of chunks owned by the arena; freeing or
+// growing the most recent block happens in place, other frees are no-ops.
+// Blocks too large to be worth bump-allocating go to the system allocator.
+// Resetting the arena keeps (at most ARENA_MAX_RETAINED bytes of) its
+// memory, so that subsequent calls don't hit malloc() at all.
 
-static SpnValue state_pop(ParserState *state)
-{
-	assert(state->stack);
+#define ARENA_CHUNK_SIZE   (16 * 1024)
+#define ARENA_LARGE_BLOCK  (64 * 1024)
+#define ARENA_MAX_RETAINED (1024 * 1024)
+#define ARENA_ALIGN        sizeof(size_t)
+#define ARENA_HEADER       sizeof(size_t)
+#define ARENA_LARGE_MARK   ((size_t)1)
 
-	StackNode *head = state->stack;
-	StackNode *next = head->next;
-	SpnValue value = head->value;
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t size;
+	size_t used;
+} ArenaChunk;
 
-	assert(spn_isnil(&head->key));
+typedef struct Arena {
+	ArenaChunk *chunks; // most recently allocated first
+} Arena;
 
-	free(head);
-	state->stack = next;
+static size_t arena_round(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
 
-	return value;
+static unsigned char *chunk_data(ArenaChunk *chunk)
+{
+	return (unsigned char *)(chunk + 1);
 }
 
-static void set_value(ParserState *state, SpnValue value)
+static ArenaChunk *arena_add_chunk(Arena *arena, size_t min_size)
 {
-	if (state->stack == NULL) {
-		state->root = value;
-	} else if (spn_isarray(&state->stack->value)) {
-		SpnArray *array = spn_arrayvalue(&state->stack->value);
-		spn_array_push(array, &value);
-		spn_value_release(&value);
-	} else if (spn_ishashmap(&state->stack->value)) {
-		SpnHashMap *hashmap = spn_hashmapvalue(&state->stack->value);
-		assert(spn_isstring(&state->stack->key));
+	size_t size = min_size > ARENA_CHUNK_SIZE ? min_size : ARENA_CHUNK_SIZE;
+	ArenaChunk *chunk = malloc(sizeof *chunk + size);
 
-		spn_hashmap_set(hashmap, &state->stack->key, &value);
-		spn_value_release(&state->stack->key);
-		spn_value_release(&value);
-		state->stack->key = spn_nilval;
-	} else {
-		assert("cannot add value to non-collection object" == NULL);
+	if (chunk == NULL) {
+		return NULL;
 	}
-}
 
+	chunk->next = arena->chunks;
+	chunk->size = size;
+	chunk->used = 0;
+	arena->chunks = chunk;
 
-// Parser callbacks
-static int cb_null(void *ctx)
-{
-	ParserState *state = ctx;
-	SpnValue nullrepr = state->explicit_null ? null_value : spn_nilval;
-	set_value(ctx, nullrepr);
-	return 1;
+	return chunk;
 }
 
-static int cb_boolean(void *ctx, int boolval)
+// Returns nonzero if 'block' is the most recent allocation of the arena
+static int arena_is_last(Arena *arena, size_t *block)
 {
-	set_value(ctx, spn_makebool(boolval));
-	return 1;
+	ArenaChunk *chunk = arena->chunks;
+	unsigned char *end = (unsigned char *)(block + 1) + *block;
+	return chunk && end == chunk_data(chunk) + chunk->used;
 }
 
-static int cb_integer(void *ctx, long long intval)
+static void *arena_malloc(void *ctx, size_t size)
 {
-	set_value(ctx, spn_makeint(intval));
-	return 1;
-}
+	Arena *arena = ctx;
+	size_t rounded = arena_round(size);
+	size_t total = ARENA_HEADER + rounded;
+	size_t *block;
 
-static int cb_double(void *ctx, double doubleval)
-{
-	set_value(ctx, spn_makefloat(doubleval));
-	return 1;
-}
+	if (total > ARENA_LARGE_BLOCK) {
+		block = malloc(ARENA_HEADER + size);
+		if (block == NULL) {
+			return NULL;
+		}
 
-static int cb_string(void *ctx, const unsigned char *strval, size_t length)
-{
-	set_value(ctx, spn_makestring_len((const char *)(strval), length));
-	return 1;
+		*block = ARENA_LARGE_MARK;
+		return block + 1;
+	}
+
+	ArenaChunk *chunk = arena->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < total) {
+		chunk = arena_add_chunk(arena, total);
+		if (chunk == NULL) {
+			return NULL;
+		}
+	}
+
+	block = (size_t *)(chunk_data(chunk) + chunk->used);
+	*block = rounded;
+	chunk->used += total;
+
+	return block + 1;
 }
 
-static int cb_start_map(void *ctx)
+static void arena_free(void *ctx, void *ptr)
 {
-	state_push(ctx, spn_makehashmap());
-	return 1;
+	Arena *arena = ctx;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	size_t *block = (size_t *)(ptr) - 1;
+
+	if (*block == ARENA_LARGE_MARK) {
+		free(block);
+	} else if (arena_is_last(arena, block)) {
+		arena->chunks->used -= ARENA_HEADER + *block;
+	}
 }
 
-static int cb_map_key(void *ctx, const unsigned char *key, size_t length)
+static void *arena_realloc(void *ctx, void *ptr, size_t size)
 {
-	ParserState *state = ctx;
-	assert(state->stack);
-	assert(spn_isnil(&state->stack->key));
+	Arena *arena = ctx;
 
-	state->stack->key = spn_makestring_len((const char *)(key), length);
-	return 1;
+	if (ptr == NULL) {
+		return arena_malloc(ctx, size);
+	}
+
+	size_t *block = (size_t *)(ptr) - 1;
+
+	if (*block == ARENA_LARGE_MARK) {
+		block = realloc(block, ARENA_HEADER + size);
+		return block ? block + 1 : NULL;
+	}
+
+	size_t old_size = *block;
+	size_t rounded = arena_round(size);
+
+	if (rounded <= old_size) {
+		return ptr;
+	}
+
+	// grow the most recent block in place if there's room for it
+	if (arena_is_last(arena, block) && ARENA_HEADER + rounded <= ARENA_LARGE_BLOCK) {
+		ArenaChunk *chunk = arena->chunks;
+		if (chunk->size - chunk->used >= rounded - old_size) {
+			chunk->used += rounded - old_size;
+			*block = rounded;
+			return ptr;
+		}
+	}
+
+	void *newptr = arena_malloc(ctx, size);
+	if (newptr == NULL) {
+		return NULL;
+	}
+
+	memcpy(newptr, ptr, old_size);
+	arena_free(ctx, ptr);
+
+	return newptr;
 }
 
-static int cb_end_map(void *ctx)
+static void arena_destroy(Arena *arena)
 {
-	set_value(ctx, state_pop(ctx));
-	return 1;
+	ArenaChunk *chunk = arena->chunks;
+
+	while (chunk) {
+		ArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	arena->chunks = NULL;
 }
 
-static int cb_start_array(void *ctx)
+// Invalidates every block of the arena. If the last use needed more than
+// one chunk, they are coalesced into a single one, so that the next use
+// of similar size fits in it without any further allocation.
+static void arena_reset(Arena *arena)
 {
-	state_push(ctx, spn_makearray());
-	return 1;
+	ArenaChunk *chunk = arena->chunks;
+
+	if (chunk == NULL) {
+		return;
+	}
+
+	if (chunk->next == NULL) {
+		chunk->used = 0;
+		return;
+	}
+
+	size_t total = 0;
+	for (; chunk; chunk = chunk->next) {
+		total += chunk->size;
+	}
+
+	arena_destroy(arena);
+
+	if (total <= ARENA_MAX_RETAINED) {
+		arena_add_chunk(arena, total);
+	}
 }
 
-static int cb_end_array(void *ctx)
+static yajl_alloc_funcs arena_alloc_funcs(Arena *arena)
 {
-	set_value(ctx, state_pop(ctx));
-	return 1;
+	return (yajl_alloc_funcs) {
+		.malloc  = arena_malloc,
+		.realloc = arena_realloc,
+		.free    = arena_free,
+		.ctx     = arena
+	};
 }
 
-static const yajl_callbacks parser_callbacks = {
-	.yajl_null        = cb_null,
-	.yajl_boolean     = cb_boolean,
-	.yajl_integer     = cb_integer,
-	.yajl_double      = cb_double,
-	.yajl_number      = NULL,
-	.yajl_string      = cb_string,
-	.yajl_start_map   = cb_start_map,
-	.yajl_map_key     = cb_map_key,
-	.yajl_end_map     = cb_end_map,
-	.yajl_start_array = cb_start_array,
-	.yajl_end_array   = cb_end_array
-};
 
-// Helper for obtaining the parser's error message
-static void error_message_to_spn_context(
-	yajl_handle hndl,
-	SpnContext *ctx,
-	const unsigned char *json,
-	size_t length
-)
-{
-	unsigned char *errmsg = yajl_get_error(hndl, 1, json, length);
-	const void *args[1] = { errmsg };
-	spn_ctx_runtime_error(ctx, "error parsing JSON: %s", args);
-	yajl_free_error(hndl, errmsg);
-}
+// String interning.
+// An open-addressing table of strings, so that equal object keys (and,
+// with 'dedup_strings', string values) share a single SpnString: this
+// saves an allocation per occurrence, and since the string caches its
+// hash, spn_hashmap_set() doesn't need to rehash keys.
+// Only short strings are interned, and the table stops admitting new
+// entries once it holds INTERN_MAX_ENTRIES of them.
+#define INTERN_MAX_LENGTH 64
+#define INTERN_MAX_ENTRIES 4096
+#define INTERN_INITIAL_CAPACITY 64
 
-static void parser_set_bool_option(
-	yajl_handle parser,
-	yajl_option opt,
-	SpnHashMap *config,
-	const char *name
-)
+typedef struct InternEntry {
+	SpnValue str; // nil if the slot is empty
+	unsigned long hash;
+} InternEntry;
+
+typedef struct InternTable {
+	InternEntry *entries;
+	size_t count;
+	size_t capacity; // always a power of two
+} InternTable;
+
+// FNV-1a
+static unsigned long hash_bytes(const unsigned char *bytes, size_t length)
 {
-	SpnValue optval = spn_hashmap_get_strkey(config, name);
-	if (spn_isbool(&optval)) {
-		yajl_config(parser, opt, spn_boolvalue(&optval));
+	unsigned long hash = 2166136261u;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
 	}
+
+	return hash;
 }
 
-static void state_set_bool_option(
-	int *opt,
-	SpnHashMap *config,
-	const char *name
+static InternEntry *intern_find_slot(
+	InternEntry *entries,
+	size_t capacity,
+	unsigned long hash,
+	const unsigned char *str,
+	size_t length
 )
 {
-	SpnValue optval = spn_hashmap_get_strkey(config, name);
-	if (spn_isbool(&optval)) {
-		*opt = spn_boolvalue(&optval);
-	}
-}
+	size_t mask = capacity - 1;
 
-static void config_parser(yajl_handle parser, ParserState *state, SpnValue config_obj)
-{
-	assert(spn_ishashmap(&config_obj));
-	SpnHashMap *config = spn_hashmapvalue(&config_obj);
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		InternEntry *entry = &entries[i];
 
-	// Allow C-style comments in JSON
-	parser_set_bool_option(parser, yajl_allow_comments, config, "comment");
+		if (spn_isnil(&entry->str)) {
+			return entry;
+		}
 
-	// parse 'null' to the special yajl.null value instead of nil
-	state_set_bool_option(&state->explicit_null, config, "parse_null");
+		if (entry->hash == hash) {
+			SpnString *strobj = spn_stringvalue(&entry->str);
+			if (strobj->len == length && memcmp(strobj->cstr, str, length) == 0) {
+				return entry;
+			}
+		}
+	}
 }
 
-static int json_parse(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+static int intern_grow(InternTable *table)
 {
-	if (argc < 1 || argc > 2) {
-		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+	size_t capacity = table->capacity ? 2 * table->capacity : INTERN_INITIAL_CAPACITY;
+	InternEntry *entries = malloc(capacity * sizeof entries[0]);
+
+	if (entries == NULL) {
 		return -1;
 	}
 
-	if (!spn_isstring(&argv[0])) {
-		spn_ctx_runtime_error(ctx, "1st argument must be a string", NULL);
-		return -2;
+	for (size_t i = 0; i < capacity; i++) {
+		entries[i].str = spn_nilval;
 	}
 
-	if (argc >= 2 && !spn_ishashmap(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "2nd argument must be a config object", NULL);
-		return -3;
+	for (size_t i = 0; i < table->capacity; i++) {
+		InternEntry *old = &table->entries[i];
+
+		if (!spn_isnil(&old->str)) {
+			SpnString *strobj = spn_stringvalue(&old->str);
+			const unsigned char *str = (const unsigned char *)(strobj->cstr);
+			*intern_find_slot(entries, capacity, old->hash, str, strobj->len) = *old;
+		}
 	}
 
-	SpnString *strobj = spn_stringvalue(&argv[0]);
-	const unsigned char *str = (const unsigned char *)(strobj->cstr);
-	size_t length = strobj->len;
-	int rv = 0;
+	free(table->entries);
+	table->entries = entries;
+	table->capacity = capacity;
 
-	ParserState state = state_init();
-	yajl_handle yajl_hndl = yajl_alloc(&parser_callbacks, NULL, &state);
+	return 0;
+}
 
-	if (argc >= 2) {
-		config_parser(yajl_hndl, &state, argv[1]);
+// Returns a new reference to a string equal to 'str'
+static SpnValue intern_string(InternTable *table, const unsigned char *str, size_t length)
+{
+	if (length > INTERN_MAX_LENGTH) {
+		return spn_makestring_len((const char *)(str), length);
 	}
 
-	yajl_status status = yajl_parse(yajl_hndl, str, length);
+	unsigned long hash = hash_bytes(str, length);
 
-	if (status != yajl_status_ok) {
-		// handle parse error
-		rv = -4;
+	if (table->capacity > 0) {
+		InternEntry *entry = intern_find_slot(table->entries, table->capacity, hash, str, length);
+
+		if (!spn_isnil(&entry->str)) {
+			spn_value_retain(&entry->str);
+			return entry->str;
+		}
 	}
 
-	status = yajl_complete_parse(yajl_hndl);
-	if (rv == 0 && status != yajl_status_ok) {
-		// garbage after input
-		rv = -5;
+	SpnValue value = spn_makestring_len((const char *)(str), length);
+
+	if (table->count >= INTERN_MAX_ENTRIES) {
+		return value;
 	}
 
-	if (rv == 0) {
-		*ret = state.root;
-	} else {
-		spn_value_release(&state.root);
-		error_message_to_spn_context(yajl_hndl, ctx, str, length);
+	// keep the load factor at or below 1/2
+	if (2 * (table->count + 1) > table->capacity && intern_grow(table) != 0) {
+		return value;
 	}
 
-	yajl_free(yajl_hndl);
-	state_free(&state);
+	InternEntry *entry = intern_find_slot(table->entries, table->capacity, hash, str, length);
+	entry->str = value;
+	entry->hash = hash;
+	spn_value_retain(&value);
+	table->count++;
 
-	return rv;
+	return value;
 }
 
-/*
- * JSON Generator (serializer) API
- */
+// Releases the strings but keeps the table's memory
+static void intern_clear(InternTable *table)
+{
+	for (size_t i = 0; i < table->capacity; i++) {
+		spn_value_release(&table->entries[i].str);
+		table->entries[i].str = spn_nilval;
+	}
 
-#define RETURN_IF_FAIL(call) \
-	do { \
-		if ((call) != yajl_gen_status_ok) { \
-			const void *args[1] = { #call }; \
-			spn_ctx_runtime_error(ctx, "YAJL error: %s", args); \
-			return -1; \
-		} \
-	} while (0)
+	table->count = 0;
+}
 
-static int generate_recursive(yajl_gen gen, SpnValue node, SpnContext *ctx)
+static void intern_free(InternTable *table)
 {
-	switch (spn_valtype(&node)) {
-	case SPN_TTAG_NIL: /* this shouldn't really happen */
-		RETURN_IF_FAIL(yajl_gen_null(gen));
-		break;
-	case SPN_TTAG_BOOL:
-		RETURN_IF_FAIL(yajl_gen_bool(gen, spn_boolvalue(&node)));
-		break;
-	case SPN_TTAG_NUMBER:
-		if (spn_isint(&node)) {
-			RETURN_IF_FAIL(yajl_gen_integer(gen, spn_intvalue(&node)));
-		} else {
-			RETURN_IF_FAIL(yajl_gen_double(gen, spn_floatvalue(&node)));
-		}
-		break;
-	case SPN_TTAG_STRING: {
-		SpnString *strobj = spn_stringvalue(&node);
-		const unsigned char *str = (const unsigned char *)(strobj->cstr);
-		size_t length = strobj->len;
-		RETURN_IF_FAIL(yajl_gen_string(gen, str, length));
-		break;
-	}
-	case SPN_TTAG_ARRAY: {
-		RETURN_IF_FAIL(yajl_gen_array_open(gen));
+	intern_clear(table);
+	free(table->entries);
+	table->entries = NULL;
+	table->capacity = 0;
+}
 
-		SpnArray *array = spn_arrayvalue(&node);
-		size_t n = spn_array_count(array);
+// Object keys seen by parsers with the 'cache_keys' option,
+// kept across calls (typically the field names of a schema).
+#define KEY_CACHE_MAX_KEYS 4096
 
-		for (size_t i = 0; i < n; i++) {
-			SpnValue elem = spn_array_get(array, i);
-			int error = generate_recursive(gen, elem, ctx);
-			if (error) {
-				return -1;
-			}
-		}
+static THREAD_LOCAL InternTable key_cache = { NULL, 0, 0 };
 
-		RETURN_IF_FAIL(yajl_gen_array_close(gen));
-		break;
+// Returns the calling thread's key cache. If it has filled up with more
+// than a schema's worth of names (keys that are really data), it starts
+// over; intern_string() would stop adding to it at this point anyway.
+static InternTable *key_cache_get(void)
+{
+	thread_cache_register();
+
+	if (key_cache.count >= KEY_CACHE_MAX_KEYS) {
+		intern_free(&key_cache);
 	}
-	case SPN_TTAG_HASHMAP: {
-		RETURN_IF_FAIL(yajl_gen_map_open(gen));
 
-		SpnHashMap *hm = spn_hashmapvalue(&node);
-		SpnValue key, val;
-		size_t cursor = 0;
+	return &key_cache;
+}
 
-		while ((cursor = spn_hashmap_next(hm, cursor, &key, &val)) != 0) {
-			int error;
 
-			error = generate_recursive(gen, key, ctx);
-			if (error) {
-				return -1;
-			}
+/*
+ * Number parsing
+ *
+ * Parsers get the text of numbers through the yajl_number callback
+ * instead of letting YAJL convert them with strtoll() and strtod().
+ * Integers are accumulated directly. For floats, Clinger's fast path
+ * covers the common case of at most 15-16 significant digits and a
+ * small exponent exactly, with a single correctly rounded floating-point
+ * operation; anything else goes to strtod().
+ */
 
-			error = generate_recursive(gen, val, ctx);
-			if (error) {
-				return -1;
-			}
+typedef struct ParsedNumber {
+	int is_integer;
+	long long intval;
+	double doubleval;
+} ParsedNumber;
+
+#define NUMBER_MAX_DIGITS 19 // always fit into a uint64_t
+#define NUMBER_MAX_EXACT  (UINT64_C(1) << 53)
+
+// powers of ten that are exactly representable as doubles
+static const double exact_pow10[23] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// The slow path for floats
+// Returned by number_parse() if a buffer can't be allocated, which
+// (unlike its other errors) says nothing about the number
+static const char number_no_memory[] = "out of memory";
+
+static const char *number_parse_strtod(const char *num, size_t length, double *doubleval)
+{
+	char stackbuf[64];
+	char *buf = length < sizeof stackbuf ? stackbuf : malloc(length + 1);
+
+	if (buf == NULL) {
+		return number_no_memory;
+	}
+
+	memcpy(buf, num, length);
+	buf[length] = 0;
+
+	errno = 0;
+	*doubleval = strtod(buf, NULL);
+	int overflow = errno == ERANGE && (*doubleval == HUGE_VAL || *doubleval == -HUGE_VAL);
+
+	if (buf != stackbuf) {
+		free(buf);
+	}
+
+	return overflow ? "numeric (floating point) overflow" : NULL;
+}
+
+// Converts the text of a number, as validated by YAJL. Returns NULL on
+// success, or an error message if the value is out of range.
+static const char *number_parse(const char *num, size_t length, ParsedNumber *number)
+{
+	const char *p = num;
+	const char *end = num + length;
+	int negative = 0;
+	uint64_t mantissa = 0;
+	int digits = 0; // significant digits in 'mantissa'
+	int truncated = 0; // some digits didn't fit into 'mantissa'
+	int exp10 = 0;
+
+	if (p < end && *p == '-') {
+		negative = 1;
+		p++;
+	}
+
+	for (; p < end && is_digit(*p); p++) {
+		if (digits < NUMBER_MAX_DIGITS) {
+			mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+			digits += mantissa != 0;
+		} else {
+			truncated = 1;
+			exp10++;
+		}
+	}
+
+	if (p == end) {
+		uint64_t max = negative ? UINT64_C(1) << 63 : (UINT64_C(1) << 63) - 1;
+
+		if (truncated || mantissa > max) {
+			return "integer overflow";
+		}
+
+		number->is_integer = 1;
+		number->intval = negative ? (long long)(0 - mantissa) : (long long)(mantissa);
+
+		return NULL;
+	}
+
+	number->is_integer = 0;
+
+	if (*p == '.') {
+		for (p++; p < end && is_digit(*p); p++) {
+			if (digits < NUMBER_MAX_DIGITS) {
+				mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+				digits += mantissa != 0;
+				exp10--;
+			} else {
+				truncated = 1;
+			}
+		}
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int exp_negative = 0;
+		int exp = 0;
+
+		p++;
+
+		if (p < end && (*p == '+' || *p == '-')) {
+			exp_negative = *p == '-';
+			p++;
+		}
+
+		for (; p < end && is_digit(*p); p++) {
+			if (exp < 100000) {
+				exp = exp * 10 + (*p - '0');
+			}
+		}
+
+		exp10 += exp_negative ? -exp : exp;
+	}
+
+	if (!truncated && mantissa <= NUMBER_MAX_EXACT) {
+		double value = (double)(mantissa);
+
+		// a mantissa with trailing zeros to spare can take some
+		// of a large exponent, e. g. 12e30 = 12e8 * 1e22
+		while (exp10 > 22 && mantissa * 10 <= NUMBER_MAX_EXACT) {
+			mantissa *= 10;
+			exp10--;
+			value = (double)(mantissa);
+		}
+
+		if (exp10 >= -22 && exp10 <= 22) {
+			value = exp10 < 0 ? value / exact_pow10[-exp10] : value * exact_pow10[exp10];
+			number->doubleval = negative ? -value : value;
+			return NULL;
+		}
+	}
+
+	return number_parse_strtod(num, length, &number->doubleval);
+}
+
+// True if number_parse() failed because the value is out of range
+static int number_out_of_range(const char *error)
+{
+	return error != NULL && error != number_no_memory;
+}
+
+// With the 'numbers: "raw"' option, numbers that number_parse() rejects
+// are kept as BigNumber objects holding their text as it appeared in the
+// input, so that e. g. 128-bit IDs survive a parse/generate round trip.
+typedef struct BigNumber {
+	SpnObject base;
+	char *digits;
+	size_t length;
+} BigNumber;
+
+static int big_number_equal(void *lhs, void *rhs)
+{
+	BigNumber *a = lhs;
+	BigNumber *b = rhs;
+	return a->length == b->length && memcmp(a->digits, b->digits, a->length) == 0;
+}
+
+static unsigned long big_number_hash(void *obj)
+{
+	BigNumber *num = obj;
+	return hash_bytes((const unsigned char *)(num->digits), num->length);
+}
+
+static void big_number_dtor(void *obj)
+{
+	BigNumber *num = obj;
+	free(num->digits);
+}
+
+static const SpnClass BigNumber_class = {
+	.instsz     = sizeof(BigNumber),
+	.equal      = big_number_equal,
+	.compare    = NULL,
+	.hashfn     = big_number_hash,
+	.destructor = big_number_dtor
+};
+
+// Returns nil if out of memory
+static SpnValue big_number_new(const char *num, size_t length)
+{
+	char *digits = malloc(length + 1);
+
+	if (digits == NULL) {
+		return spn_nilval;
+	}
+
+	BigNumber *big = spn_object_new(&BigNumber_class);
+	big->digits = digits;
+	big->length = length;
+	memcpy(big->digits, num, length);
+	big->digits[length] = 0;
+
+	return spn_makestrguserinfo(big);
+}
+
+static const BigNumber *big_number_value(const SpnValue *value)
+{
+	if (!spn_isstrguserinfo(value) || spn_objvalue(value)->isa != &BigNumber_class) {
+		return NULL;
+	}
+
+	return (const BigNumber *)(spn_objvalue(value));
+}
+
+// YAJL["digits"](number): the text of a BigNumber
+static int json_number_digits(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting 1 argument", NULL);
+		return -1;
+	}
+
+	const BigNumber *big = big_number_value(&argv[0]);
+	if (big == NULL) {
+		spn_ctx_runtime_error(ctx, "argument must be a raw number", NULL);
+		return -2;
+	}
+
+	*ret = spn_makestring_len(big->digits, big->length);
+
+	return 0;
+}
+
+
+// Field selection ('fields' option).
+// The selected paths form a trie; a node marked 'all' selects the whole
+// subtree below it. Arrays are transparent: the selector of an array
+// applies to each of its elements.
+typedef struct Selector {
+	char *name;
+	size_t length;
+	struct Selector *children;
+	size_t nchildren;
+	size_t capacity;
+	int all;
+} Selector;
+
+static const Selector *selector_child(const Selector *sel, const unsigned char *name, size_t length)
+{
+	for (size_t i = 0; i < sel->nchildren; i++) {
+		const Selector *child = &sel->children[i];
+		if (child->length == length && memcmp(child->name, name, length) == 0) {
+			return child;
+		}
+	}
+
+	return NULL;
+}
+
+static Selector *selector_add_child(Selector *sel, const char *name, size_t length)
+{
+	Selector *child = (Selector *)(selector_child(sel, (const unsigned char *)(name), length));
+
+	if (child) {
+		return child;
+	}
+
+	if (sel->nchildren == sel->capacity) {
+		size_t capacity = sel->capacity ? 2 * sel->capacity : 4;
+		sel->children = realloc(sel->children, capacity * sizeof sel->children[0]);
+		sel->capacity = capacity;
+	}
+
+	child = &sel->children[sel->nchildren++];
+	child->name = malloc(length + 1);
+	memcpy(child->name, name, length);
+	child->name[length] = 0;
+	child->length = length;
+	child->children = NULL;
+	child->nchildren = 0;
+	child->capacity = 0;
+	child->all = 0;
+
+	return child;
+}
+
+// Adds a dotted path, e. g. "user.address.city"
+static void selector_add_path(Selector *root, const char *path, size_t length)
+{
+	Selector *sel = root;
+	const char *end = path + length;
+
+	while (path <= end) {
+		const char *dot = memchr(path, '.', end - path);
+		const char *segment_end = dot ? dot : end;
+
+		sel = selector_add_child(sel, path, segment_end - path);
+		path = segment_end + 1;
+	}
+
+	sel->all = 1;
+}
+
+static void selector_free(Selector *sel)
+{
+	for (size_t i = 0; i < sel->nchildren; i++) {
+		selector_free(&sel->children[i]);
+	}
+
+	free(sel->children);
+	free(sel->name);
+}
+
+// Builds a selector from an array of path strings
+static Selector *selector_new(SpnArray *paths)
+{
+	Selector *root = calloc(1, sizeof *root);
+	size_t n = spn_array_count(paths);
+
+	for (size_t i = 0; i < n; i++) {
+		SpnValue path = spn_array_get(paths, i);
+
+		if (spn_isstring(&path)) {
+			SpnString *str = spn_stringvalue(&path);
+			selector_add_path(root, str->cstr, str->len);
+		}
+	}
+
+	return root;
+}
+
+
+// JSON Pointers (RFC 6901), split into their reference tokens.
+// Used by 'extract' and the 'stop_after_path' option.
+typedef struct PointerToken {
+	char *str;
+	size_t length;
+	size_t index; // SIZE_MAX if the token isn't an array index
+} PointerToken;
+
+typedef struct JsonPointer {
+	PointerToken *tokens;
+	size_t ntokens;
+} JsonPointer;
+
+static size_t pointer_token_index(const char *str, size_t length)
+{
+	size_t index = 0;
+
+	// no leading zeroes, and "-" (past the end) never matches
+	if (length == 0 || (str[0] == '0' && length > 1)) {
+		return SIZE_MAX;
+	}
+
+	for (size_t i = 0; i < length; i++) {
+		if (str[i] < '0' || str[i] > '9' || index > (SIZE_MAX - 10) / 10) {
+			return SIZE_MAX;
+		}
+
+		index = index * 10 + (size_t)(str[i] - '0');
+	}
+
+	return index;
+}
+
+// Splits a pointer into its unescaped reference tokens.
+// Returns 0 if the pointer is malformed.
+static int pointer_parse(JsonPointer *pointer, const char *ptr, size_t length)
+{
+	const char *end = ptr + length;
+
+	pointer->tokens = NULL;
+	pointer->ntokens = 0;
+
+	if (length == 0) {
+		return 1; // the whole document
+	}
+
+	if (ptr[0] != '/') {
+		return 0;
+	}
+
+	while (ptr < end) {
+		const char *begin = ptr + 1;
+		const char *slash = memchr(begin, '/', end - begin);
+		const char *token_end = slash ? slash : end;
+		char *str = malloc(token_end - begin + 1);
+		size_t n = 0;
+
+		for (const char *p = begin; p < token_end; p++) {
+			if (*p != '~') {
+				str[n++] = *p;
+			} else if (p + 1 < token_end && (p[1] == '0' || p[1] == '1')) {
+				str[n++] = p[1] == '0' ? '~' : '/';
+				p++;
+			} else {
+				free(str);
+				return 0;
+			}
+		}
+
+		str[n] = 0;
+
+		pointer->tokens = realloc(pointer->tokens, (pointer->ntokens + 1) * sizeof pointer->tokens[0]);
+		pointer->tokens[pointer->ntokens++] = (PointerToken) {
+			.str = str,
+			.length = n,
+			.index = pointer_token_index(str, n)
+		};
+
+		ptr = token_end;
+	}
+
+	return 1;
+}
+
+static void pointer_free(JsonPointer *pointer)
+{
+	for (size_t i = 0; i < pointer->ntokens; i++) {
+		free(pointer->tokens[i].str);
+	}
+
+	free(pointer->tokens);
+	pointer->tokens = NULL;
+	pointer->ntokens = 0;
+}
+
+
+// parser state
+
+// The container stack is a single contiguous, growable array
+// so that entering and leaving collections costs no heap traffic.
+#define STATE_STACK_INITIAL_CAPACITY 16
+
+typedef struct StackNode {
+	SpnValue key; // for maps only
+	SpnValue value;
+	const Selector *sel; // selected members; NULL means everything
+} StackNode;
+
+typedef struct ParserState {
+	SpnValue root;
+	StackNode *stack;
+	size_t depth;
+	size_t capacity;
+	int has_root; // a complete top-level value has been parsed
+	const char *error; // set by callbacks that cancel the parse
+	InternTable local_keys; // object keys of the current document
+	InternTable *keys; // either &local_keys or &key_cache
+	InternTable local_strings; // string values, with 'dedup_strings'
+	InternTable *strings; // &local_strings or NULL
+	int explicit_null;
+	int raw_numbers; // keep numbers out of range as BigNumber
+	int multiple; // a sequence of documents, e. g. NDJSON
+	SpnValue each; // called with every document if 'multiple'
+	long count; // number of documents if 'multiple'
+	SpnContext *ctx; // for calling 'each'
+	int error_reported; // error is already set on 'ctx'
+	Selector *fields; // with 'fields', the selected paths
+	const Selector *pending; // selector for the value of the current key
+	int skip_next; // the next value isn't selected
+	size_t skip; // nesting depth inside a skipped value
+	long limit; // stop after this many elements/documents (if positive)
+	JsonPointer *stop_path; // stop once the value at this path is complete
+	int stopped; // the parse has been cancelled by 'limit' or 'stop_path'
+	int nonblank; // some input other than whitespace has been seen
+} ParserState;
+
+static ParserState state_init()
+{
+	return (ParserState) {
+		.root = spn_nilval,
+		.stack = NULL,
+		.depth = 0,
+		.capacity = 0,
+		.has_root = 0,
+		.error = NULL,
+		.local_keys = { NULL, 0, 0 },
+		.keys = NULL,
+		.local_strings = { NULL, 0, 0 },
+		.strings = NULL,
+		.explicit_null = 0,
+		.raw_numbers = 0,
+		.multiple = 0,
+		.each = spn_nilval,
+		.count = 0,
+		.ctx = NULL,
+		.error_reported = 0,
+		.fields = NULL,
+		.pending = NULL,
+		.skip_next = 0,
+		.skip = 0,
+		.limit = 0,
+		.stop_path = NULL,
+		.stopped = 0,
+		.nonblank = 0
+	};
+}
+
+// Releases all values but keeps the stack buffer for the next parse
+static void state_reset(ParserState *state)
+{
+	for (size_t i = 0; i < state->depth; i++) {
+		spn_value_release(&state->stack[i].key);
+		spn_value_release(&state->stack[i].value);
+	}
+
+	spn_value_release(&state->root);
+	spn_value_release(&state->each);
+	intern_clear(&state->local_keys);
+	intern_clear(&state->local_strings);
+
+	state->root = spn_nilval;
+	state->depth = 0;
+	state->has_root = 0;
+	state->error = NULL;
+	state->multiple = 0;
+	state->each = spn_nilval;
+	state->count = 0;
+	state->ctx = NULL;
+	state->error_reported = 0;
+
+	if (state->fields) {
+		selector_free(state->fields);
+		free(state->fields);
+		state->fields = NULL;
+	}
+
+	state->pending = NULL;
+	state->skip_next = 0;
+	state->skip = 0;
+
+	if (state->stop_path) {
+		pointer_free(state->stop_path);
+		free(state->stop_path);
+		state->stop_path = NULL;
+	}
+
+	state->limit = 0;
+	state->stopped = 0;
+	state->nonblank = 0;
+}
+
+static void state_free(ParserState *state)
+{
+	state_reset(state);
+	intern_free(&state->local_keys);
+	intern_free(&state->local_strings);
+	free(state->stack);
+}
+
+// Parsers may be reused across documents (see PooledParser),
+// so YAJL won't catch a second top-level value; this does.
+static int state_reject_trailing(ParserState *state)
+{
+	if (state->depth == 0 && state->has_root && !state->multiple) {
+		state->error = "trailing garbage";
+		return 1;
+	}
+
+	return 0;
+}
+
+static StackNode *state_top(ParserState *state)
+{
+	return state->depth ? &state->stack[state->depth - 1] : NULL;
+}
+
+static int state_push(ParserState *state, SpnValue collection)
+{
+	assert(spn_isarray(&collection) || spn_ishashmap(&collection));
+
+	if (state_reject_trailing(state)) {
+		spn_value_release(&collection);
+		return 0;
+	}
+
+	// the members of an array are selected like the array itself
+	StackNode *parent = state_top(state);
+	const Selector *sel = state->fields;
+
+	if (parent) {
+		sel = spn_isarray(&parent->value) ? parent->sel : state->pending;
+	}
+
+	if (state->depth == state->capacity) {
+		size_t capacity = state->capacity ? 2 * state->capacity : STATE_STACK_INITIAL_CAPACITY;
+		state->stack = realloc(state->stack, capacity * sizeof state->stack[0]);
+		state->capacity = capacity;
+	}
+
+	StackNode *node = &state->stack[state->depth++];
+	node->key = spn_nilval;
+	node->value = collection;
+	node->sel = sel;
+
+	return 1;
+}
+
+static SpnValue state_pop(ParserState *state)
+{
+	assert(state->depth > 0);
+
+	StackNode *head = &state->stack[--state->depth];
+	assert(spn_isnil(&head->key));
+
+	return head->value;
+}
+
+// Cancels the parse because the requested data is complete.
+// The parse then counts as successful; see state_unwind().
+static int state_stop(ParserState *state)
+{
+	state->stopped = 1;
+	return 0;
+}
+
+// Takes care of a complete top-level value in 'multiple' mode:
+// appends it to the resulting array or passes it to 'each'.
+static int state_emit(ParserState *state, SpnValue value)
+{
+	state->count++;
+
+	if (spn_isnil(&state->each)) {
+		spn_array_push(spn_arrayvalue(&state->root), &value);
+		spn_value_release(&value);
+	} else {
+		SpnValue rv = spn_nilval;
+		int error = spn_ctx_callfunc(state->ctx, spn_funcvalue(&state->each), &rv, 1, &value);
+
+		spn_value_release(&value);
+		spn_value_release(&rv);
+
+		if (error) {
+			state->error_reported = 1;
+			return 0;
+		}
+	}
+
+	if (state->limit > 0 && state->count >= state->limit) {
+		return state_stop(state);
+	}
+
+	return 1;
+}
+
+// Whether the value being completed is the one at 'path'. For maps,
+// the key of the member is still on the stack; for arrays, the index
+// of the new element is the current count.
+static int state_at_path(ParserState *state, const JsonPointer *path)
+{
+	if (path->ntokens != state->depth) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < state->depth; i++) {
+		const StackNode *node = &state->stack[i];
+		const PointerToken *token = &path->tokens[i];
+
+		if (spn_isarray(&node->value)) {
+			if (token->index != spn_array_count(spn_arrayvalue(&node->value))) {
+				return 0;
+			}
+		} else {
+			SpnString *key = spn_stringvalue(&node->key);
+
+			if (key->len != token->length || memcmp(key->cstr, token->str, key->len) != 0) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static int set_value(ParserState *state, SpnValue value)
+{
+	StackNode *top = state_top(state);
+
+	if (state_reject_trailing(state)) {
+		spn_value_release(&value);
+		return 0;
+	}
+
+	int stop = state->stop_path && !state->stopped && state_at_path(state, state->stop_path);
+
+	if (top == NULL) {
+		if (state->multiple) {
+			if (!state_emit(state, value)) {
+				return 0;
+			}
+		} else {
+			state->root = value;
+			state->has_root = 1;
+		}
+	} else if (spn_isarray(&top->value)) {
+		SpnArray *array = spn_arrayvalue(&top->value);
+		spn_array_push(array, &value);
+		spn_value_release(&value);
+
+		// 'limit' also applies to the elements of a top-level array
+		if (state->limit > 0 && state->depth == 1 && !state->multiple
+		    && (long)(spn_array_count(array)) >= state->limit) {
+			stop = 1;
+		}
+	} else if (spn_ishashmap(&top->value)) {
+		SpnHashMap *hashmap = spn_hashmapvalue(&top->value);
+		assert(spn_isstring(&top->key));
+
+		spn_hashmap_set(hashmap, &top->key, &value);
+		spn_value_release(&top->key);
+		spn_value_release(&value);
+		top->key = spn_nilval;
+	} else {
+		assert("cannot add value to non-collection object" == NULL);
+	}
+
+	return stop ? state_stop(state) : 1;
+}
+
+// After a stop, adds the collections that are still open to their
+// parents, so that the root holds everything that has been parsed.
+static void state_unwind(ParserState *state)
+{
+	while (state->depth > 0) {
+		set_value(state, state_pop(state));
+	}
+}
+
+
+// Parser callbacks
+// Returns nonzero if the current event belongs to a value that is not
+// selected, and should be ignored. 'nesting' is 1 for the start of a
+// collection, -1 for its end and 0 for anything else.
+static int state_skip(ParserState *state, int nesting)
+{
+	if (state->skip > 0) {
+		state->skip += nesting;
+		return 1;
+	}
+
+	if (state->skip_next) {
+		state->skip_next = 0;
+		state->skip = nesting > 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int cb_null(void *ctx)
+{
+	ParserState *state = ctx;
+
+	if (state_skip(state, 0)) {
+		return 1;
+	}
+
+	SpnValue nullrepr = state->explicit_null ? null_value : spn_nilval;
+	return set_value(ctx, nullrepr);
+}
+
+static int cb_boolean(void *ctx, int boolval)
+{
+	if (state_skip(ctx, 0)) {
+		return 1;
+	}
+
+	return set_value(ctx, spn_makebool(boolval));
+}
+
+static int cb_integer(void *ctx, long long intval)
+{
+	if (state_skip(ctx, 0)) {
+		return 1;
+	}
+
+	return set_value(ctx, spn_makeint(intval));
+}
+
+static int cb_double(void *ctx, double doubleval)
+{
+	if (state_skip(ctx, 0)) {
+		return 1;
+	}
+
+	return set_value(ctx, spn_makefloat(doubleval));
+}
+
+static int cb_number(void *ctx, const char *numval, size_t length)
+{
+	ParserState *state = ctx;
+	ParsedNumber number;
+	const char *error = number_parse(numval, length, &number);
+
+	if (number_out_of_range(error) && state->raw_numbers) {
+		if (state_skip(state, 0)) {
+			return 1;
+		}
+
+		SpnValue big = big_number_new(numval, length);
+
+		if (spn_isnil(&big)) {
+			state->error = number_no_memory;
+			return 0;
+		}
+
+		return set_value(state, big);
+	}
+
+	if (error) {
+		state->error = error;
+		return 0;
+	}
+
+	return number.is_integer ? cb_integer(ctx, number.intval) : cb_double(ctx, number.doubleval);
+}
+
+static int cb_string(void *ctx, const unsigned char *strval, size_t length)
+{
+	ParserState *state = ctx;
+	SpnValue value;
+
+	if (state_skip(state, 0)) {
+		return 1;
+	}
+
+	if (state->strings) {
+		value = intern_string(state->strings, strval, length);
+	} else {
+		value = spn_makestring_len((const char *)(strval), length);
+	}
+
+	return set_value(state, value);
+}
+
+static int cb_start_map(void *ctx)
+{
+	if (state_skip(ctx, 1)) {
+		return 1;
+	}
+
+	return state_push(ctx, spn_makehashmap());
+}
+
+static int cb_map_key(void *ctx, const unsigned char *key, size_t length)
+{
+	ParserState *state = ctx;
+
+	if (state->skip > 0) {
+		return 1;
+	}
+
+	StackNode *top = state_top(state);
+	assert(top);
+	assert(spn_isnil(&top->key));
+
+	if (top->sel) {
+		const Selector *child = selector_child(top->sel, key, length);
+
+		if (child == NULL) {
+			state->skip_next = 1;
+			return 1;
+		}
+
+		state->pending = child->all ? NULL : child;
+	} else {
+		state->pending = NULL;
+	}
+
+	top->key = intern_string(state->keys, key, length);
+	return 1;
+}
+
+static int cb_end_map(void *ctx)
+{
+	if (state_skip(ctx, -1)) {
+		return 1;
+	}
+
+	return set_value(ctx, state_pop(ctx));
+}
+
+static int cb_start_array(void *ctx)
+{
+	if (state_skip(ctx, 1)) {
+		return 1;
+	}
+
+	return state_push(ctx, spn_makearray());
+}
+
+static int cb_end_array(void *ctx)
+{
+	if (state_skip(ctx, -1)) {
+		return 1;
+	}
+
+	return set_value(ctx, state_pop(ctx));
+}
+
+static const yajl_callbacks parser_callbacks = {
+	.yajl_null        = cb_null,
+	.yajl_boolean     = cb_boolean,
+	.yajl_integer     = cb_integer,
+	.yajl_double      = cb_double,
+	.yajl_number      = cb_number,
+	.yajl_string      = cb_string,
+	.yajl_start_map   = cb_start_map,
+	.yajl_map_key     = cb_map_key,
+	.yajl_end_map     = cb_end_map,
+	.yajl_start_array = cb_start_array,
+	.yajl_end_array   = cb_end_array
+};
+
+/*
+ * Tape: a flat representation of parsed JSON
+ *
+ * A document is stored as an array of 64-bit words, each holding a tag
+ * in its top byte and a payload in the rest, plus a buffer of string
+ * bytes. Building a tape doesn't touch any Sparkling objects, so it can
+ * be done on any thread; tape_replay() turns it into values later.
+ *
+ * If the tape has a 'source' (the text being parsed, which must outlive
+ * the tape), strings that YAJL passes straight out of it aren't copied:
+ * their offset in 'source' is recorded instead, flagged TAPE_IN_SOURCE.
+ * Only strings with escapes, which YAJL decodes into a buffer of its
+ * own, end up in 'strings'.
+ *
+ *  TAPE_NULL, TAPE_TRUE, TAPE_FALSE    no payload
+ *  TAPE_INT, TAPE_DOUBLE               the value is in the next word
+ *  TAPE_STRING, TAPE_KEY,              payload: offset in 'strings' or
+ *  TAPE_NUMBER                         'source'; the next word is the
+ *                                      length
+ *  TAPE_START_ARRAY, TAPE_START_MAP    payload: index of the word after
+ *                                      the matching end word
+ *  TAPE_END_ARRAY, TAPE_END_MAP        payload: number of elements
+ */
+
+enum {
+	TAPE_NULL,
+	TAPE_TRUE,
+	TAPE_FALSE,
+	TAPE_INT,
+	TAPE_DOUBLE,
+	TAPE_STRING,
+	TAPE_KEY,
+	TAPE_NUMBER, // the text of a number out of range, with 'raw_numbers'
+	TAPE_START_ARRAY,
+	TAPE_END_ARRAY,
+	TAPE_START_MAP,
+	TAPE_END_MAP
+};
+
+#define TAPE_TAG_SHIFT     56
+#define TAPE_PAYLOAD_MASK  ((UINT64_C(1) << TAPE_TAG_SHIFT) - 1)
+#define TAPE_WORD(tag, payload) (((uint64_t)(tag) << TAPE_TAG_SHIFT) | (payload))
+#define TAPE_TAG(word)     ((int)((word) >> TAPE_TAG_SHIFT))
+#define TAPE_PAYLOAD(word) ((word) & TAPE_PAYLOAD_MASK)
+#define TAPE_IN_SOURCE     (UINT64_C(1) << (TAPE_TAG_SHIFT - 1))
+
+typedef struct Tape {
+	uint64_t *words;
+	size_t nwords;
+	size_t words_capacity;
+	unsigned char *strings;
+	size_t nbytes;
+	size_t strings_capacity;
+	const unsigned char *source; // not owned
+	size_t source_length;
+	int failed; // out of memory
+} Tape;
+
+static Tape tape_init()
+{
+	return (Tape) {
+		.words = NULL,
+		.nwords = 0,
+		.words_capacity = 0,
+		.strings = NULL,
+		.nbytes = 0,
+		.strings_capacity = 0,
+		.source = NULL,
+		.source_length = 0,
+		.failed = 0
+	};
+}
+
+// The bytes of the string (or number) whose first word is 'word'
+static const unsigned char *tape_string(const Tape *tape, uint64_t word)
+{
+	uint64_t offset = TAPE_PAYLOAD(word);
+
+	if (offset & TAPE_IN_SOURCE) {
+		return tape->source + (offset & ~TAPE_IN_SOURCE);
+	}
+
+	return tape->strings + offset;
+}
+
+static void tape_free(Tape *tape)
+{
+	free(tape->words);
+	free(tape->strings);
+	*tape = tape_init();
+}
+
+static int tape_grow(void **buf, size_t *capacity, size_t needed, size_t elemsize)
+{
+	if (needed <= *capacity) {
+		return 0;
+	}
+
+	size_t newcap = *capacity ? 2 * *capacity : 64;
+	while (newcap < needed) {
+		newcap *= 2;
+	}
+
+	void *newbuf = realloc(*buf, newcap * elemsize);
+	if (newbuf == NULL) {
+		return -1;
+	}
+
+	*buf = newbuf;
+	*capacity = newcap;
+
+	return 0;
+}
+
+static int tape_push(Tape *tape, uint64_t word)
+{
+	void *words = tape->words;
+
+	if (tape_grow(&words, &tape->words_capacity, tape->nwords + 1, sizeof word) != 0) {
+		tape->failed = 1;
+		return 0;
+	}
+
+	tape->words = words;
+	tape->words[tape->nwords++] = word;
+
+	return 1;
+}
+
+static int tape_push_string(Tape *tape, int tag, const unsigned char *str, size_t length)
+{
+	uintptr_t from = (uintptr_t)(tape->source);
+	uintptr_t p = (uintptr_t)(str);
+
+	if (tape->source && p >= from && length <= tape->source_length && p - from <= tape->source_length - length) {
+		return tape_push(tape, TAPE_WORD(tag, TAPE_IN_SOURCE | (p - from)))
+		    && tape_push(tape, length);
+	}
+
+	void *strings = tape->strings;
+
+	if (tape_grow(&strings, &tape->strings_capacity, tape->nbytes + length, 1) != 0) {
+		tape->failed = 1;
+		return 0;
+	}
+
+	tape->strings = strings;
+	memcpy(tape->strings + tape->nbytes, str, length);
+
+	if (!tape_push(tape, TAPE_WORD(tag, tape->nbytes)) || !tape_push(tape, length)) {
+		return 0;
+	}
+
+	tape->nbytes += length;
+
+	return 1;
+}
+
+// Builds a tape from YAJL callbacks. The start word of an open
+// container temporarily holds the number of its elements.
+typedef struct TapeBuilder {
+	Tape *tape;
+	size_t *open; // indices of start words of open containers
+	size_t depth;
+	size_t capacity;
+	const char *error; // set by callbacks that cancel the parse
+	int raw_numbers; // record numbers out of range as TAPE_NUMBER
+} TapeBuilder;
+
+static TapeBuilder tape_builder_init(Tape *tape, int raw_numbers)
+{
+	return (TapeBuilder) {
+		.tape = tape,
+		.open = NULL,
+		.depth = 0,
+		.capacity = 0,
+		.error = NULL,
+		.raw_numbers = raw_numbers
+	};
+}
+
+static void tape_builder_free(TapeBuilder *builder)
+{
+	free(builder->open);
+}
+
+static void tape_count_element(TapeBuilder *builder)
+{
+	if (builder->depth > 0) {
+		builder->tape->words[builder->open[builder->depth - 1]]++;
+	}
+}
+
+static int tape_value(TapeBuilder *builder, uint64_t word)
+{
+	tape_count_element(builder);
+	return tape_push(builder->tape, word);
+}
+
+static int tape_open(TapeBuilder *builder, int tag)
+{
+	void *open = builder->open;
+
+	if (tape_grow(&open, &builder->capacity, builder->depth + 1, sizeof builder->open[0]) != 0) {
+		builder->tape->failed = 1;
+		return 0;
+	}
+
+	builder->open = open;
+	builder->open[builder->depth] = builder->tape->nwords;
+
+	if (!tape_value(builder, TAPE_WORD(tag, 0))) {
+		return 0;
+	}
+
+	builder->depth++;
+
+	return 1;
+}
+
+static int tape_close(TapeBuilder *builder, int tag)
+{
+	assert(builder->depth > 0);
+
+	Tape *tape = builder->tape;
+	size_t start = builder->open[--builder->depth];
+	uint64_t count = TAPE_PAYLOAD(tape->words[start]);
+
+	if (!tape_push(tape, TAPE_WORD(tag, count))) {
+		return 0;
+	}
+
+	tape->words[start] = TAPE_WORD(TAPE_TAG(tape->words[start]), tape->nwords);
+
+	return 1;
+}
+
+static int tb_null(void *ctx)
+{
+	return tape_value(ctx, TAPE_WORD(TAPE_NULL, 0));
+}
+
+static int tb_boolean(void *ctx, int boolval)
+{
+	return tape_value(ctx, TAPE_WORD(boolval ? TAPE_TRUE : TAPE_FALSE, 0));
+}
+
+static int tb_integer(void *ctx, long long intval)
+{
+	TapeBuilder *builder = ctx;
+	return tape_value(builder, TAPE_WORD(TAPE_INT, 0))
+	    && tape_push(builder->tape, (uint64_t)(intval));
+}
+
+static int tb_double(void *ctx, double doubleval)
+{
+	TapeBuilder *builder = ctx;
+	uint64_t bits;
+	memcpy(&bits, &doubleval, sizeof bits);
+
+	return tape_value(builder, TAPE_WORD(TAPE_DOUBLE, 0))
+	    && tape_push(builder->tape, bits);
+}
+
+static int tb_number(void *ctx, const char *numval, size_t length)
+{
+	TapeBuilder *builder = ctx;
+	ParsedNumber number;
+	const char *error = number_parse(numval, length, &number);
+
+	if (number_out_of_range(error) && builder->raw_numbers) {
+		tape_count_element(builder);
+		return tape_push_string(builder->tape, TAPE_NUMBER, (const unsigned char *)(numval), length);
+	}
+
+	if (error) {
+		builder->error = error;
+		return 0;
+	}
+
+	return number.is_integer ? tb_integer(ctx, number.intval) : tb_double(ctx, number.doubleval);
+}
+
+static int tb_string(void *ctx, const unsigned char *strval, size_t length)
+{
+	TapeBuilder *builder = ctx;
+	tape_count_element(builder);
+	return tape_push_string(builder->tape, TAPE_STRING, strval, length);
+}
+
+static int tb_map_key(void *ctx, const unsigned char *key, size_t length)
+{
+	TapeBuilder *builder = ctx;
+	return tape_push_string(builder->tape, TAPE_KEY, key, length);
+}
+
+static int tb_start_map(void *ctx)
+{
+	return tape_open(ctx, TAPE_START_MAP);
+}
+
+static int tb_end_map(void *ctx)
+{
+	return tape_close(ctx, TAPE_END_MAP);
+}
+
+static int tb_start_array(void *ctx)
+{
+	return tape_open(ctx, TAPE_START_ARRAY);
+}
+
+static int tb_end_array(void *ctx)
+{
+	return tape_close(ctx, TAPE_END_ARRAY);
+}
+
+static const yajl_callbacks tape_callbacks = {
+	.yajl_null        = tb_null,
+	.yajl_boolean     = tb_boolean,
+	.yajl_integer     = tb_integer,
+	.yajl_double      = tb_double,
+	.yajl_number      = tb_number,
+	.yajl_string      = tb_string,
+	.yajl_start_map   = tb_start_map,
+	.yajl_map_key     = tb_map_key,
+	.yajl_end_map     = tb_end_map,
+	.yajl_start_array = tb_start_array,
+	.yajl_end_array   = tb_end_array
+};
+
+// Feeds words [begin, end) of the tape to a set of YAJL callbacks, as if
+// the original text was being parsed. Returns 0 if a callback cancelled.
+static int tape_replay(
+	const Tape *tape,
+	size_t begin,
+	size_t end,
+	const yajl_callbacks *cb,
+	void *ctx
+)
+{
+	size_t i = begin;
+
+	while (i < end) {
+		uint64_t word = tape->words[i++];
+		int ok;
+
+		switch (TAPE_TAG(word)) {
+		case TAPE_NULL:
+			ok = cb->yajl_null(ctx);
+			break;
+		case TAPE_TRUE:
+			ok = cb->yajl_boolean(ctx, 1);
+			break;
+		case TAPE_FALSE:
+			ok = cb->yajl_boolean(ctx, 0);
+			break;
+		case TAPE_INT:
+			ok = cb->yajl_integer(ctx, (long long)(tape->words[i++]));
+			break;
+		case TAPE_DOUBLE: {
+			double doubleval;
+			memcpy(&doubleval, &tape->words[i++], sizeof doubleval);
+			ok = cb->yajl_double(ctx, doubleval);
+			break;
+		}
+		case TAPE_STRING:
+		case TAPE_KEY:
+		case TAPE_NUMBER: {
+			const unsigned char *str = tape_string(tape, word);
+			size_t length = tape->words[i++];
+
+			if (TAPE_TAG(word) == TAPE_STRING) {
+				ok = cb->yajl_string(ctx, str, length);
+			} else if (TAPE_TAG(word) == TAPE_KEY) {
+				ok = cb->yajl_map_key(ctx, str, length);
+			} else {
+				ok = cb->yajl_number(ctx, (const char *)(str), length);
+			}
+
+			break;
+		}
+		case TAPE_START_ARRAY:
+			ok = cb->yajl_start_array(ctx);
+			break;
+		case TAPE_END_ARRAY:
+			ok = cb->yajl_end_array(ctx);
+			break;
+		case TAPE_START_MAP:
+			ok = cb->yajl_start_map(ctx);
+			break;
+		case TAPE_END_MAP:
+			ok = cb->yajl_end_map(ctx);
+			break;
+		default:
+			assert("invalid tape word" == NULL);
+			ok = 0;
+		}
+
+		if (!ok) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+// Helper for obtaining the parser's error message
+static void error_message_to_spn_context(
+	yajl_handle hndl,
+	SpnContext *ctx,
+	const unsigned char *json,
+	size_t length
+)
+{
+	// without the source text, only a short message can be rendered
+	unsigned char *errmsg = yajl_get_error(hndl, json != NULL, json, length);
+	const void *args[1] = { errmsg };
+	spn_ctx_runtime_error(ctx, "error parsing JSON: %s", args);
+	yajl_free_error(hndl, errmsg);
+}
+
+// Parser configuration. 'yajl_flags' are set on the YAJL handle
+// itself, so handles are pooled per distinct set of flags.
+typedef struct ParserOptions {
+	unsigned yajl_flags;
+	int explicit_null;
+	int cache_keys;
+	int dedup_strings;
+	int lines;
+	SpnValue each; // borrowed from the config object
+	long threads;
+	SpnValue fields; // borrowed from the config object
+	long limit;
+	SpnValue stop_after_path; // borrowed from the config object
+	int lazy;
+	int raw_numbers;
+} ParserOptions;
+
+static ParserOptions default_parser_options()
+{
+	return (ParserOptions) {
+		.yajl_flags = 0,
+		.explicit_null = 0,
+		.cache_keys = 0,
+		.dedup_strings = 0,
+		.lines = 0,
+		.each = spn_nilval,
+		.threads = 1,
+		.fields = spn_nilval,
+		.limit = 0,
+		.stop_after_path = spn_nilval,
+		.lazy = 0,
+		.raw_numbers = 0
+	};
+}
+
+static void parser_set_flag_option(
+	unsigned *flags,
+	yajl_option opt,
+	SpnHashMap *config,
+	const char *name
+)
+{
+	SpnValue optval = spn_hashmap_get_strkey(config, name);
+	if (spn_isbool(&optval)) {
+		if (spn_boolvalue(&optval)) {
+			*flags |= opt;
+		} else {
+			*flags &= ~(unsigned)(opt);
+		}
+	}
+}
+
+static void set_bool_option(
+	int *opt,
+	SpnHashMap *config,
+	const char *name
+)
+{
+	SpnValue optval = spn_hashmap_get_strkey(config, name);
+	if (spn_isbool(&optval)) {
+		*opt = spn_boolvalue(&optval);
+	}
+}
+
+static void set_int_option(
+	long *opt,
+	SpnHashMap *config,
+	const char *name
+)
+{
+	SpnValue optval = spn_hashmap_get_strkey(config, name);
+	if (spn_isint(&optval)) {
+		*opt = spn_intvalue(&optval);
+	}
+}
+
+static void config_parser(ParserOptions *options, SpnValue config_obj)
+{
+	assert(spn_ishashmap(&config_obj));
+	SpnHashMap *config = spn_hashmapvalue(&config_obj);
+
+	// Allow C-style comments in JSON
+	parser_set_flag_option(&options->yajl_flags, yajl_allow_comments, config, "comment");
+
+	// parse 'null' to the special yajl.null value instead of nil
+	set_bool_option(&options->explicit_null, config, "parse_null");
+
+	// keep interned object keys around for subsequent calls
+	set_bool_option(&options->cache_keys, config, "cache_keys");
+
+	// share equal (short) string values in the resulting tree
+	set_bool_option(&options->dedup_strings, config, "dedup_strings");
+
+	// parse a sequence of documents (e. g. newline-delimited JSON)
+	set_bool_option(&options->lines, config, "lines");
+
+	// with 'lines', call this function with each document
+	SpnValue each = spn_hashmap_get_strkey(config, "each");
+	if (spn_isfunc(&each)) {
+		options->each = each;
+	}
+
+	// parse large inputs on this many threads
+	set_int_option(&options->threads, config, "threads");
+
+	// only build the members at these (dotted) paths
+	SpnValue fields = spn_hashmap_get_strkey(config, "fields");
+	if (spn_isarray(&fields)) {
+		options->fields = fields;
+	}
+
+	// stop after this many array elements (or documents, with 'lines')
+	set_int_option(&options->limit, config, "limit");
+
+	// stop once the value at this JSON Pointer has been parsed
+	SpnValue stop_after_path = spn_hashmap_get_strkey(config, "stop_after_path");
+	if (spn_isstring(&stop_after_path)) {
+		options->stop_after_path = stop_after_path;
+	}
+
+	// return a LazyDocument instead of building the value
+	set_bool_option(&options->lazy, config, "lazy");
+
+	// "raw": keep numbers out of range as their original text
+	SpnValue numbers = spn_hashmap_get_strkey(config, "numbers");
+	if (spn_isstring(&numbers)) {
+		options->raw_numbers = strcmp(spn_stringvalue(&numbers)->cstr, "raw") == 0;
+	}
+}
+
+// Pool of ready-to-use parser handles.
+// YAJL 2 has no way of resetting a parser, but a handle in 'multiple
+// values' mode accepts a new document once the previous one has been
+// completed successfully. state_reject_trailing() restores the single
+// document semantics, and handles which saw an error are discarded.
+// Each pooled parser owns its ParserState (the callback context) and
+// the arena its handle allocates from.
+#define PARSER_POOL_SIZE 4
+
+typedef struct PooledParser {
+	yajl_handle handle;
+	unsigned yajl_flags;
+	int in_use;
+	int pooled;
+	ParserState state;
+	Arena arena;
+} PooledParser;
+
+static THREAD_LOCAL PooledParser parser_pool[PARSER_POOL_SIZE];
+
+static void config_handle_flags(yajl_handle hndl, unsigned yajl_flags)
+{
+	static const yajl_option flag_options[] = {
+		yajl_allow_comments,
+		yajl_allow_multiple_values
+	};
+
+	for (size_t i = 0; i < sizeof flag_options / sizeof flag_options[0]; i++) {
+		if (yajl_flags & flag_options[i]) {
+			yajl_config(hndl, flag_options[i], 1);
+		}
+	}
+}
+
+static void parser_create_handle(PooledParser *parser, unsigned yajl_flags)
+{
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&parser->arena);
+	parser->handle = yajl_alloc(&parser_callbacks, &alloc_funcs, &parser->state);
+	parser->yajl_flags = yajl_flags;
+
+	config_handle_flags(parser->handle, yajl_flags | yajl_allow_multiple_values);
+}
+
+static void parser_destroy_handle(PooledParser *parser)
+{
+	if (parser->handle) {
+		yajl_free(parser->handle);
+		parser->handle = NULL;
+	}
+
+	arena_reset(&parser->arena);
+}
+
+static void parser_configure(PooledParser *parser, const ParserOptions *options)
+{
+	if (parser->handle == NULL) {
+		parser_create_handle(parser, options->yajl_flags);
+	}
+
+	parser->in_use = 1;
+	parser->state.explicit_null = options->explicit_null;
+	parser->state.raw_numbers = options->raw_numbers;
+	parser->state.keys = options->cache_keys ? key_cache_get() : &parser->state.local_keys;
+	parser->state.strings = options->dedup_strings ? &parser->state.local_strings : NULL;
+
+	if (spn_isarray(&options->fields)) {
+		parser->state.fields = selector_new(spn_arrayvalue(&options->fields));
+	}
+
+	parser->state.limit = options->limit;
+
+	if (spn_isstring(&options->stop_after_path)) {
+		SpnString *str = spn_stringvalue(&options->stop_after_path);
+		JsonPointer *path = malloc(sizeof *path);
+
+		// a malformed pointer never matches
+		if (pointer_parse(path, str->cstr, str->len)) {
+			parser->state.stop_path = path;
+		} else {
+			pointer_free(path);
+			free(path);
+		}
+	}
+
+	if (options->lines) {
+		ParserState *state = &parser->state;
+		state->multiple = 1;
+		state->has_root = 1;
+		state->each = options->each;
+		spn_value_retain(&state->each);
+
+		if (spn_isnil(&state->each)) {
+			state->root = spn_makearray();
+		}
+	}
+}
+
+// A parser that doesn't belong to the pool, for re-entrant calls and
+// for parsers that live longer than a single call (StreamParser).
+static PooledParser *parser_new(const ParserOptions *options)
+{
+	PooledParser *parser = calloc(1, sizeof *parser);
+	parser->state = state_init();
+	parser_configure(parser, options);
+	return parser;
+}
+
+static PooledParser *parser_acquire(const ParserOptions *options)
+{
+	PooledParser *parser = NULL;
+	thread_cache_register();
+
+	// prefer an idle handle with the right configuration,
+	// then an empty slot, then any idle slot
+	for (size_t i = 0; i < PARSER_POOL_SIZE && parser == NULL; i++) {
+		PooledParser *p = &parser_pool[i];
+		if (!p->in_use && p->handle && p->yajl_flags == options->yajl_flags) {
+			parser = p;
+		}
+	}
+
+	for (size_t i = 0; i < PARSER_POOL_SIZE && parser == NULL; i++) {
+		if (!parser_pool[i].in_use && parser_pool[i].handle == NULL) {
+			parser = &parser_pool[i];
+		}
+	}
+
+	for (size_t i = 0; i < PARSER_POOL_SIZE && parser == NULL; i++) {
+		if (!parser_pool[i].in_use) {
+			parser = &parser_pool[i];
+			parser_destroy_handle(parser);
+		}
+	}
+
+	// all pooled parsers are busy (re-entrant call): use a private one
+	if (parser == NULL) {
+		return parser_new(options);
+	}
+
+	if (!parser->pooled) {
+		// first use of this slot
+		parser->state = state_init();
+		parser->pooled = 1;
+	}
+
+	parser_configure(parser, options);
+
+	return parser;
+}
+
+// 'reusable' must only be nonzero if the last document was parsed
+// and completed successfully, leaving the handle in a clean state.
+static void parser_release(PooledParser *parser, int reusable)
+{
+	// a cancelled handle can't parse any further documents
+	if (parser->state.stopped) {
+		reusable = 0;
+	}
+
+	state_reset(&parser->state);
+
+	if (!reusable || !parser->pooled) {
+		parser_destroy_handle(parser);
+	}
+
+	if (parser->pooled) {
+		parser->in_use = 0;
+	} else {
+		state_free(&parser->state);
+		arena_destroy(&parser->arena);
+		free(parser);
+	}
+}
+
+static void parser_report_error(
+	PooledParser *parser,
+	SpnContext *ctx,
+	const unsigned char *json,
+	size_t length
+)
+{
+	if (parser->state.error_reported) {
+		return;
+	}
+
+	if (parser->state.error) {
+		const void *args[1] = { parser->state.error };
+		spn_ctx_runtime_error(ctx, "error parsing JSON: %s", args);
+	} else {
+		error_message_to_spn_context(parser->handle, ctx, json, length);
+	}
+}
+
+// True if 'json' is only whitespace, as far as YAJL is concerned
+static int json_is_blank(const unsigned char *json, size_t length)
+{
+	for (size_t i = 0; i < length; i++) {
+		switch (json[i]) {
+		case ' ': case '\t': case '\n': case '\r': case '\v': case '\f':
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Parses the next chunk of a document. 'ctx' receives the error, if any.
+static int parser_feed(
+	PooledParser *parser,
+	const unsigned char *json,
+	size_t length,
+	SpnContext *ctx
+)
+{
+	parser->state.ctx = ctx;
+
+	// the rest of the input is ignored after a stop
+	if (parser->state.stopped) {
+		return 0;
+	}
+
+	if (!parser->state.nonblank) {
+		parser->state.nonblank = !json_is_blank(json, length);
+	}
+
+	if (yajl_parse(parser->handle, json, length) != yajl_status_ok && !parser->state.stopped) {
+		parser_report_error(parser, ctx, json, length);
+		return -4;
+	}
+
+	return 0;
+}
+
+static void parser_take_result(PooledParser *parser, SpnValue *ret)
+{
+	ParserState *state = &parser->state;
+
+	if (state->multiple && !spn_isnil(&state->each)) {
+		*ret = spn_makeint(state->count);
+	} else {
+		*ret = state->root;
+		state->root = spn_nilval;
+	}
+}
+
+// Finishes the document and moves its value into '*ret'. 'json' is the
+// last chunk parsed (if still available), for rendering error messages.
+static int parser_complete(
+	PooledParser *parser,
+	SpnValue *ret,
+	SpnContext *ctx,
+	const unsigned char *json,
+	size_t length
+)
+{
+	ParserState *state = &parser->state;
+	state->ctx = ctx;
+
+	if (state->stopped) {
+		state_unwind(state);
+		parser_take_result(parser, ret);
+		return 0;
+	}
+
+	// A fresh YAJL handle reports empty input as a premature EOF, a
+	// reused one doesn't. For a sequence of documents it's always valid:
+	// there are none.
+	if (state->multiple && !state->nonblank) {
+		parser_take_result(parser, ret);
+		return 0;
+	}
+
+	if (yajl_complete_parse(parser->handle) != yajl_status_ok) {
+		// incomplete input
+		parser_report_error(parser, ctx, json, length);
+		return -5;
+	}
+
+	if (!state->has_root) {
+		// a reused handle accepts empty input
+		state->error = "premature EOF";
+		parser_report_error(parser, ctx, json, length);
+		return -5;
+	}
+
+	parser_take_result(parser, ret);
+
+	return 0;
+}
+
+// Parses a complete input in one go
+static int parse_serial(
+	PooledParser *parser,
+	const unsigned char *json,
+	size_t length,
+	SpnValue *ret,
+	SpnContext *ctx
+)
+{
+	int rv = parser_feed(parser, json, length, ctx);
+
+	if (rv == 0) {
+		rv = parser_complete(parser, ret, ctx, json, length);
+	}
+
+	return rv;
+}
+
+/*
+ * Parallel parsing
+ *
+ * Large inputs are split into chunks which are parsed concurrently, each
+ * by its own YAJL handle, into a Tape. The tapes are then replayed in
+ * order into the parser's ParserState on the calling thread, since
+ * Sparkling values can only be created there. Two kinds of input are
+ * split:
+ *
+ * - with 'lines', a sequence of documents is split at newlines. Since a
+ *   document can span several lines, a chunk may fail to parse on its
+ *   own; everything from such a chunk onwards is parsed serially, which
+ *   also produces the proper error message for real syntax errors.
+ *
+ * - a single top-level array is split between its elements, found by a
+ *   quick structural pre-scan. Each chunk is parsed as an array of its
+ *   own, and their elements are stitched together. If any chunk fails,
+ *   the whole input is parsed serially instead.
+ */
+
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+#define PARALLEL_MAX_THREADS 64
+
+typedef struct ParseJob {
+	const unsigned char *json;
+	size_t length;
+	int wrap; // parse the text surrounded by '[' and ']'
+	int raw_numbers;
+	Tape tape;
+	int ok;
+	pthread_t thread;
+	int started;
+	Arena arena; // for the job's YAJL handle
+} ParseJob;
+
+static void *parse_job_run(void *arg)
+{
+	static const unsigned char open_bracket[] = "[";
+	static const unsigned char close_bracket[] = "]";
+
+	ParseJob *job = arg;
+	TapeBuilder builder = tape_builder_init(&job->tape, job->raw_numbers);
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&job->arena);
+	yajl_handle hndl = yajl_alloc(&tape_callbacks, &alloc_funcs, &builder);
+
+	if (job->wrap) {
+		job->ok = yajl_parse(hndl, open_bracket, 1) == yajl_status_ok
+		       && yajl_parse(hndl, job->json, job->length) == yajl_status_ok
+		       && yajl_parse(hndl, close_bracket, 1) == yajl_status_ok
+		       && yajl_complete_parse(hndl) == yajl_status_ok;
+	} else {
+		yajl_config(hndl, yajl_allow_multiple_values, 1);
+		job->ok = yajl_parse(hndl, job->json, job->length) == yajl_status_ok
+		       && yajl_complete_parse(hndl) == yajl_status_ok;
+	}
+
+	yajl_free(hndl);
+	arena_destroy(&job->arena);
+	tape_builder_free(&builder);
+
+	return NULL;
+}
+
+// Runs the jobs concurrently; the calling thread takes the first one
+static void parse_jobs_run(ParseJob *jobs, size_t n)
+{
+	for (size_t i = 1; i < n; i++) {
+		jobs[i].started = pthread_create(&jobs[i].thread, NULL, parse_job_run, &jobs[i]) == 0;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (jobs[i].started) {
+			pthread_join(jobs[i].thread, NULL);
+		} else {
+			parse_job_run(&jobs[i]);
+		}
+	}
+}
+
+static void parse_jobs_free(ParseJob *jobs, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		tape_free(&jobs[i].tape);
+	}
+
+	free(jobs);
+}
+
+static size_t parallel_chunk_count(const ParserOptions *options, size_t length)
+{
+	size_t n = length / PARALLEL_MIN_CHUNK;
+	size_t max = options->threads < PARALLEL_MAX_THREADS ? options->threads : PARALLEL_MAX_THREADS;
+	return n < max ? n : max;
+}
+
+// Returns nonzero if 'parse_parallel' may split the input
+static int parallel_applicable(const ParserOptions *options, size_t length)
+{
+	// a chunk boundary in a comment would confuse the splitting, and
+	// with an early stop, most of the chunks would be parsed in vain
+	return options->threads > 1
+	    && !(options->yajl_flags & yajl_allow_comments)
+	    && options->limit <= 0
+	    && spn_isnil(&options->stop_after_path)
+	    && length >= 2 * PARALLEL_MIN_CHUNK;
+}
+
+static int parse_parallel_lines(
+	PooledParser *parser,
+	const ParserOptions *options,
+	const unsigned char *json,
+	size_t length,
+	SpnValue *ret,
+	SpnContext *ctx
+)
+{
+	size_t njobs = parallel_chunk_count(options, length);
+	ParseJob *jobs = calloc(njobs, sizeof jobs[0]);
+	const unsigned char *end = json + length;
+
+	if (jobs == NULL) {
+		return parse_serial(parser, json, length, ret, ctx);
+	}
+
+	const unsigned char *begin = json;
+	size_t n = 0;
+
+	// split after the newline following each ideal boundary
+	for (size_t i = 1; i <= njobs && begin < end; i++) {
+		const unsigned char *split = end;
+
+		if (i < njobs) {
+			const unsigned char *ideal = json + i * (length / njobs);
+			const unsigned char *from = ideal > begin ? ideal : begin;
+			const unsigned char *nl = memchr(from, '\n', end - from);
+			split = nl ? nl + 1 : end;
+		}
+
+		ParseJob *job = &jobs[n++];
+		job->json = begin;
+		job->length = split - begin;
+		job->raw_numbers = options->raw_numbers;
+		job->tape = tape_init();
+		job->tape.source = job->json;
+		job->tape.source_length = job->length;
+		begin = split;
+	}
+
+	parse_jobs_run(jobs, n);
+
+	// materialize values in order, up to the first chunk that failed
+	ParserState *state = &parser->state;
+	size_t k;
+	int rv = 0;
+
+	state->ctx = ctx;
+
+	for (k = 0; k < n && jobs[k].ok; k++) {
+		Tape *tape = &jobs[k].tape;
+
+		if (!tape_replay(tape, 0, tape->nwords, &parser_callbacks, state)) {
+			parser_report_error(parser, ctx, NULL, 0);
+			rv = -4;
+			break;
+		}
+
+		tape_free(tape);
+	}
+
+	if (rv == 0 && k < n) {
+		const unsigned char *rest = jobs[k].json;
+		rv = parse_serial(parser, rest, end - rest, ret, ctx);
+	} else if (rv == 0) {
+		// the parser's own handle saw no input and is still reusable
+		parser_take_result(parser, ret);
+	}
+
+	parse_jobs_free(jobs, n);
+
+	return rv;
+}
+
+static int is_json_space(unsigned char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// The structural pre-scan examines 16 bytes at a time where SSE2 is
+// available (which it always is on x86-64), and falls back to a plain
+// loop elsewhere and for the last few bytes of the input.
+#ifdef __SSE2__
+static size_t lowest_set_bit(unsigned mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	size_t n = 0;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+#endif
+
+static int is_structural(unsigned char c)
+{
+	return c == '"' || c == ',' || c == '[' || c == ']' || c == '{' || c == '}';
+}
+
+// Returns the index of the first quote, comma, bracket or brace
+// at or after json[i], or 'length' if there's none.
+static size_t scan_structural(const unsigned char *json, size_t length, size_t i)
+{
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i comma = _mm_set1_epi8(',');
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	const __m128i brace_open = _mm_set1_epi8('{'); // '[' | 0x20 == '{'
+	const __m128i brace_close = _mm_set1_epi8('}'); // ']' | 0x20 == '}'
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(json + i));
+		__m128i folded = _mm_or_si128(block, case_bit);
+		__m128i hits = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, comma)),
+			_mm_or_si128(_mm_cmpeq_epi8(folded, brace_open), _mm_cmpeq_epi8(folded, brace_close))
+		);
+		unsigned mask = _mm_movemask_epi8(hits);
+
+		if (mask) {
+			return i + lowest_set_bit(mask);
+		}
+	}
+#endif
+
+	for (; i < length; i++) {
+		if (is_structural(json[i])) {
+			return i;
+		}
+	}
+
+	return length;
+}
+
+// Returns the index of the closing quote of the string whose contents
+// start at json[i], or 'length' if it's unterminated.
+static size_t scan_string(const unsigned char *json, size_t length, size_t i)
+{
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+
+	while (i + 16 <= length) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(json + i));
+		__m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash));
+		unsigned mask = _mm_movemask_epi8(hits);
+
+		if (mask == 0) {
+			i += 16;
+			continue;
+		}
+
+		i += lowest_set_bit(mask);
+
+		if (json[i] == '"') {
+			return i;
+		}
+
+		// skip the escaped character
+		i += 2;
+	}
+#endif
+
+	while (i < length) {
+		if (json[i] == '"') {
+			return i;
+		}
+
+		i += json[i] == '\\' ? 2 : 1;
+	}
+
+	return length;
+}
+
+// Structural pre-scan of the array starting at json[begin]. Only string
+// boundaries and nesting are tracked, nothing is validated. For each of
+// the 'nsplits' ideal boundaries between equal-sized chunks, the first
+// top-level comma after it is stored in 'splits'; '*found' is set to the
+// number of those. Returns the index of the bracket closing the array,
+// or 0 if it's not closed.
+static size_t scan_array(
+	const unsigned char *json,
+	size_t length,
+	size_t begin,
+	size_t *splits,
+	size_t nsplits,
+	size_t *found
+)
+{
+	size_t depth = 0;
+	size_t next = 0;
+	size_t ideal = length / (nsplits + 1);
+	size_t i = scan_structural(json, length, begin);
+
+	for (; i < length; i = scan_structural(json, length, i + 1)) {
+		switch (json[i]) {
+		case '"':
+			i = scan_string(json, length, i + 1);
+			break;
+		case '[':
+		case '{':
+			depth++;
+			break;
+		case ']':
+		case '}':
+			if (--depth == 0) {
+				*found = next;
+				return i;
+			}
+			break;
+		case ',':
+			if (depth == 1 && next < nsplits && i >= ideal) {
+				splits[next++] = i;
+				ideal = (next + 1) * (length / (nsplits + 1));
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	*found = next;
+	return 0;
+}
+
+static int parse_parallel_array(
+	PooledParser *parser,
+	const ParserOptions *options,
+	const unsigned char *json,
+	size_t length,
+	SpnValue *ret,
+	SpnContext *ctx
+)
+{
+	size_t begin = 0;
+
+	while (begin < length && is_json_space(json[begin])) {
+		begin++;
+	}
+
+	if (begin == length || json[begin] != '[') {
+		return parse_serial(parser, json, length, ret, ctx);
+	}
+
+	size_t splits[PARALLEL_MAX_THREADS];
+	size_t nsplits = 0;
+	size_t njobs = parallel_chunk_count(options, length);
+	size_t close = scan_array(json, length, begin, splits, njobs - 1, &nsplits);
+
+	// the rest must be whitespace for the split to be equivalent
+	size_t rest = close + 1;
+	while (close && rest < length && is_json_space(json[rest])) {
+		rest++;
+	}
+
+	if (close == 0 || json[close] != ']' || rest < length || nsplits == 0) {
+		return parse_serial(parser, json, length, ret, ctx);
+	}
+
+	// chunk i spans from after its opening bracket or comma to
+	// its closing bracket or comma
+	size_t n = nsplits + 1;
+	ParseJob *jobs = calloc(n, sizeof jobs[0]);
+
+	if (jobs == NULL) {
+		return parse_serial(parser, json, length, ret, ctx);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		size_t from = i == 0 ? begin : splits[i - 1];
+		size_t to = i == nsplits ? close : splits[i];
+
+		jobs[i].json = json + from + 1;
+		jobs[i].length = to - from - 1;
+		jobs[i].wrap = 1;
+		jobs[i].raw_numbers = options->raw_numbers;
+		jobs[i].tape = tape_init();
+		jobs[i].tape.source = jobs[i].json;
+		jobs[i].tape.source_length = jobs[i].length;
+	}
+
+	parse_jobs_run(jobs, n);
+
+	// an empty chunk means a stray comma, which a single array can't have
+	int ok = 1;
+	for (size_t i = 0; i < n && ok; i++) {
+		Tape *tape = &jobs[i].tape;
+		ok = jobs[i].ok && TAPE_PAYLOAD(tape->words[tape->nwords - 1]) > 0;
+	}
+
+	int rv;
+
+	if (ok) {
+		ParserState *state = &parser->state;
+		state->ctx = ctx;
+
+		ok = cb_start_array(state);
+
+		for (size_t i = 0; i < n && ok; i++) {
+			Tape *tape = &jobs[i].tape;
+			ok = tape_replay(tape, 1, tape->nwords - 1, &parser_callbacks, state);
+			tape_free(tape);
+		}
+
+		ok = ok && cb_end_array(state);
+
+		if (ok) {
+			// the parser's own handle saw no input and is still reusable
+			parser_take_result(parser, ret);
+			rv = 0;
+		} else {
+			parser_report_error(parser, ctx, NULL, 0);
+			rv = -4;
+		}
+	} else {
+		rv = parse_serial(parser, json, length, ret, ctx);
+	}
+
+	parse_jobs_free(jobs, n);
+
+	return rv;
+}
+
+// Parses the complete input 'json' and puts the result in '*ret'.
+// The parser must be at the start of a document (or of a sequence).
+static int parse_parallel(
+	PooledParser *parser,
+	const ParserOptions *options,
+	const unsigned char *json,
+	size_t length,
+	SpnValue *ret,
+	SpnContext *ctx
+)
+{
+	if (options->lines) {
+		return parse_parallel_lines(parser, options, json, length, ret, ctx);
+	} else {
+		return parse_parallel_array(parser, options, json, length, ret, ctx);
+	}
+}
+
+/*
+ * Structural index
+ *
+ * A fast path for parsing a complete document that's in memory. The first
+ * stage classifies 64 bytes at a time with SIMD instructions and records
+ * the positions of the structural characters ({}[]:,), the unescaped
+ * quotes and the first character of every other token (numbers and
+ * literals). The second stage walks those positions and drives a set of
+ * YAJL callbacks, looking at the bytes themselves only for strings and
+ * scalars. The index is built a buffer at a time, as it's consumed, so it
+ * takes a fixed amount of memory.
+ *
+ * The fast path accepts exactly what YAJL does, but gives up on anything
+ * unusual: errors of any kind, and \u escapes of surrogates, which YAJL
+ * decodes in its own peculiar way. The caller then parses the document
+ * with YAJL, which also renders the error message. The classifier is
+ * picked at run time: AVX2 or SSE2 on x86-64, plain C elsewhere.
+ */
+
+#define INDEX_BLOCK_SIZE  64
+#define INDEX_BUFFER_SIZE 1024 // positions per refill (at least)
+
+typedef struct BlockMasks {
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t space;
+	uint64_t op; // {}[]:,
+	uint64_t control; // below 0x20
+} BlockMasks;
+
+static int is_index_op(unsigned char c)
+{
+	return c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',';
+}
+
+static void classify_generic(const unsigned char *block, BlockMasks *masks)
+{
+	BlockMasks m = { 0, 0, 0, 0, 0 };
+
+	for (int i = 0; i < INDEX_BLOCK_SIZE; i++) {
+		uint64_t bit = UINT64_C(1) << i;
+		unsigned char c = block[i];
+
+		m.quote |= c == '"' ? bit : 0;
+		m.backslash |= c == '\\' ? bit : 0;
+		m.space |= is_json_space(c) ? bit : 0;
+		m.op |= is_index_op(c) ? bit : 0;
+		m.control |= c < 0x20 ? bit : 0;
+	}
+
+	*masks = m;
+}
+
+#ifdef __SSE2__
+static void classify_sse2(const unsigned char *block, BlockMasks *masks)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	const __m128i max_control = _mm_set1_epi8(0x1f);
+	BlockMasks m = { 0, 0, 0, 0, 0 };
+
+	for (int i = 0; i < INDEX_BLOCK_SIZE; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+		__m128i folded = _mm_or_si128(v, case_bit); // '[' and ']' become '{' and '}'
+		__m128i space = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')))
+		);
+		__m128i op = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(',')))
+		);
+		__m128i control = _mm_cmpeq_epi8(_mm_max_epu8(v, max_control), max_control);
+
+		m.quote |= (uint64_t)(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote))) << i;
+		m.backslash |= (uint64_t)(_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash))) << i;
+		m.space |= (uint64_t)(_mm_movemask_epi8(space)) << i;
+		m.op |= (uint64_t)(_mm_movemask_epi8(op)) << i;
+		m.control |= (uint64_t)(_mm_movemask_epi8(control)) << i;
+	}
+
+	*masks = m;
+}
+#endif
+
+#ifdef INDEX_AVX2
+__attribute__((target("avx2")))
+static void classify_avx2(const unsigned char *block, BlockMasks *masks)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	const __m256i case_bit = _mm256_set1_epi8(0x20);
+	const __m256i max_control = _mm256_set1_epi8(0x1f);
+	BlockMasks m = { 0, 0, 0, 0, 0 };
+
+	for (int i = 0; i < INDEX_BLOCK_SIZE; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+		__m256i folded = _mm256_or_si256(v, case_bit);
+		__m256i space = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')))
+		);
+		__m256i op = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')))
+		);
+		__m256i control = _mm256_cmpeq_epi8(_mm256_max_epu8(v, max_control), max_control);
+
+		m.quote |= (uint64_t)((uint32_t)(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)))) << i;
+		m.backslash |= (uint64_t)((uint32_t)(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslash)))) << i;
+		m.space |= (uint64_t)((uint32_t)(_mm256_movemask_epi8(space))) << i;
+		m.op |= (uint64_t)((uint32_t)(_mm256_movemask_epi8(op))) << i;
+		m.control |= (uint64_t)((uint32_t)(_mm256_movemask_epi8(control))) << i;
+	}
+
+	*masks = m;
+}
+#endif
+
+typedef void (*ClassifyFunc)(const unsigned char *block, BlockMasks *masks);
+
+static ClassifyFunc classify_block = classify_generic;
+static pthread_once_t classify_once = PTHREAD_ONCE_INIT;
+
+static void classify_select(void)
+{
+#ifdef __SSE2__
+	classify_block = classify_sse2;
+#endif
+
+#ifdef INDEX_AVX2
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		classify_block = classify_avx2;
+	}
+#endif
+}
+
+// Bit i of the result is the parity of bits 0...i of 'x'
+static uint64_t prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+// Returns the characters escaped by a backslash. In a run of backslashes,
+// every other one escapes the next character; '*carry' tells whether the
+// first character of the next block is escaped.
+static uint64_t find_escaped(uint64_t backslash, uint64_t *carry)
+{
+	const uint64_t even_bits = UINT64_C(0x5555555555555555);
+
+	backslash &= ~*carry;
+
+	uint64_t follows_escape = backslash << 1 | *carry;
+	uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+	uint64_t even_ends = odd_starts + backslash;
+
+	*carry = even_ends < odd_starts; // the addition overflowed
+
+	return (even_bits ^ (even_ends << 1)) & follows_escape;
+}
+
+static size_t lowest_set_bit64(uint64_t mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(mask);
+#else
+	size_t n = 0;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+typedef struct StructuralIndex {
+	const unsigned char *json;
+	size_t length;
+	size_t offset; // of the next block to classify
+	size_t positions[INDEX_BUFFER_SIZE + INDEX_BLOCK_SIZE];
+	size_t count;
+	size_t next;
+	uint64_t in_string; // all ones if the last block ended inside a string
+	uint64_t escaped; // the first character of the next block is escaped
+	uint64_t scalar; // the last block ended inside a scalar
+	int invalid; // a control character inside a string
+} StructuralIndex;
+
+static void index_fill(StructuralIndex *ix)
+{
+	ix->count = 0;
+	ix->next = 0;
+
+	while (ix->count < INDEX_BUFFER_SIZE && ix->offset < ix->length) {
+		const unsigned char *block = ix->json + ix->offset;
+		unsigned char padded[INDEX_BLOCK_SIZE];
+		BlockMasks m;
+
+		if (ix->length - ix->offset < INDEX_BLOCK_SIZE) {
+			memset(padded, ' ', sizeof padded);
+			memcpy(padded, block, ix->length - ix->offset);
+			block = padded;
+		}
+
+		classify_block(block, &m);
+
+		uint64_t quote = m.quote & ~find_escaped(m.backslash, &ix->escaped);
+		uint64_t in_string = prefix_xor(quote) ^ ix->in_string; // opening quotes included
+		uint64_t scalar = ~(m.op | m.space | quote | in_string);
+		uint64_t scalar_start = scalar & ~(scalar << 1 | ix->scalar);
+		uint64_t tokens = (m.op & ~in_string) | quote | scalar_start;
+
+		ix->invalid |= (m.control & in_string) != 0;
+		ix->in_string = in_string >> 63 ? UINT64_MAX : 0;
+		ix->scalar = scalar >> 63;
+
+		while (tokens) {
+			ix->positions[ix->count++] = ix->offset + lowest_set_bit64(tokens);
+			tokens &= tokens - 1;
+		}
+
+		ix->offset += INDEX_BLOCK_SIZE;
+	}
+}
+
+// Returns the position of the next token, or SIZE_MAX at the end of the
+// input or if the input is known to be invalid.
+static size_t index_next(StructuralIndex *ix)
+{
+	if (ix->next == ix->count) {
+		index_fill(ix);
+	}
+
+	if (ix->invalid || ix->next == ix->count) {
+		return SIZE_MAX;
+	}
+
+	return ix->positions[ix->next++];
+}
+
+typedef struct IndexParser {
+	StructuralIndex index;
+	const yajl_callbacks *cb;
+	void *ctx;
+	unsigned char *stack; // 1 for each open map, 0 for each open array
+	size_t depth;
+	size_t capacity;
+	int opened; // the last value was the start of a container
+	int malformed; // the fast path gave up on the input
+	unsigned char *buf; // unescaped strings
+	size_t buf_capacity;
+} IndexParser;
+
+// Length of the UTF-8 sequence starting at 's', or 0 if it's malformed.
+// Like YAJL, only checks the lead byte and the number of continuation bytes.
+static size_t utf8_sequence_length(const unsigned char *s, const unsigned char *end)
+{
+	size_t n = (*s >> 5) == 0x06 ? 2 : (*s >> 4) == 0x0e ? 3 : (*s >> 3) == 0x1e ? 4 : 0;
+
+	if (n == 0 || (size_t)(end - s) < n) {
+		return 0;
+	}
+
+	for (size_t i = 1; i < n; i++) {
+		if ((s[i] >> 6) != 0x02) {
+			return 0;
+		}
+	}
+
+	return n;
+}
+
+static int parse_hex4(const unsigned char *s, unsigned *codepoint)
+{
+	*codepoint = 0;
+
+	for (int i = 0; i < 4; i++) {
+		unsigned char c = s[i];
+		unsigned digit;
+
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+			digit = (c | 0x20) - 'a' + 10;
+		} else {
+			return 0;
+		}
+
+		*codepoint = *codepoint << 4 | digit;
+	}
+
+	return 1;
+}
+
+static size_t encode_utf8(unsigned codepoint, unsigned char *out)
+{
+	if (codepoint < 0x80) {
+		out[0] = codepoint;
+		return 1;
+	}
+
+	if (codepoint < 0x800) {
+		out[0] = 0xc0 | codepoint >> 6;
+		out[1] = 0x80 | (codepoint & 0x3f);
+		return 2;
+	}
+
+	out[0] = 0xe0 | codepoint >> 12;
+	out[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+	out[2] = 0x80 | (codepoint & 0x3f);
+	return 3;
+}
+
+// Validates and unescapes the contents of a string, [s, end), into
+// ip->buf. Control characters have been ruled out by the first stage.
+static int index_unescape(IndexParser *ip, const unsigned char *s, const unsigned char *end, size_t *length)
+{
+	size_t needed = end - s; // unescaping never makes a string longer
+
+	if (needed > ip->buf_capacity) {
+		unsigned char *buf = realloc(ip->buf, needed);
+		if (buf == NULL) {
+			return 0;
+		}
+
+		ip->buf = buf;
+		ip->buf_capacity = needed;
+	}
+
+	unsigned char *out = ip->buf;
+
+	while (s < end) {
+		if (*s == '\\') {
+			unsigned codepoint;
+
+			if (end - s < 2) {
+				return 0;
+			}
+
+			switch (s[1]) {
+			case '"':
+			case '\\':
+			case '/': *out++ = s[1]; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+				// surrogates are left to YAJL
+				if (end - s < 6 || !parse_hex4(s + 2, &codepoint) || (codepoint & 0xf800) == 0xd800) {
+					return 0;
+				}
+
+				out += encode_utf8(codepoint, out);
+				s += 4;
+				break;
+			default:
+				return 0;
+			}
+
+			s += 2;
+		} else if (*s < 0x80) {
+			*out++ = *s++;
+		} else {
+			size_t n = utf8_sequence_length(s, end);
+			if (n == 0) {
+				return 0;
+			}
+
+			memcpy(out, s, n);
+			out += n;
+			s += n;
+		}
+	}
+
+	*length = out - ip->buf;
+
+	return 1;
+}
+
+// The string whose opening quote is at 'open'; its closing quote is the
+// next position in the index.
+static int index_string(IndexParser *ip, size_t open, const unsigned char **str, size_t *length)
+{
+	size_t close = index_next(&ip->index);
+
+	if (close == SIZE_MAX) {
+		ip->malformed = 1;
+		return 0;
+	}
+
+	assert(ip->index.json[close] == '"');
+
+	const unsigned char *begin = ip->index.json + open + 1;
+	const unsigned char *end = ip->index.json + close;
+	const unsigned char *s = begin;
+
+	// the common case: nothing to check or unescape
+	while (s < end && *s != '\\' && *s < 0x80) {
+		s++;
+	}
+
+	if (s == end) {
+		*str = begin;
+		*length = end - begin;
+		return 1;
+	}
+
+	if (!index_unescape(ip, begin, end, length)) {
+		ip->malformed = 1;
+		return 0;
+	}
+
+	*str = ip->buf;
+
+	return 1;
+}
+
+// Length of the number starting at 's' according to the JSON grammar,
+// or 0 if it's malformed.
+static size_t number_length(const unsigned char *s, const unsigned char *end)
+{
+	const unsigned char *p = s;
+
+	if (p < end && *p == '-') {
+		p++;
+	}
+
+	if (p == end || !is_digit(*p)) {
+		return 0;
+	}
+
+	if (*p == '0') {
+		p++;
+	} else {
+		while (p < end && is_digit(*p)) {
+			p++;
+		}
+	}
+
+	if (p < end && *p == '.') {
+		if (++p == end || !is_digit(*p)) {
+			return 0;
+		}
+
+		while (p < end && is_digit(*p)) {
+			p++;
+		}
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		if (++p < end && (*p == '+' || *p == '-')) {
+			p++;
+		}
+
+		if (p == end || !is_digit(*p)) {
+			return 0;
+		}
+
+		while (p < end && is_digit(*p)) {
+			p++;
+		}
+	}
+
+	return p - s;
+}
+
+static int match_literal(const unsigned char *s, const unsigned char *end, const char *literal, size_t *length)
+{
+	*length = strlen(literal);
+	return (size_t)(end - s) >= *length && memcmp(s, literal, *length) == 0;
+}
+
+// Numbers, true, false and null
+static int index_scalar(IndexParser *ip, size_t pos)
+{
+	const unsigned char *s = ip->index.json + pos;
+	const unsigned char *end = ip->index.json + ip->index.length;
+	size_t length;
+	int literal = match_literal(s, end, "true", &length)
+	           || match_literal(s, end, "false", &length)
+	           || match_literal(s, end, "null", &length);
+
+	if (!literal) {
+		length = number_length(s, end);
+	}
+
+	// a scalar ends at whitespace, a structural character or the end
+	if (length == 0 || (s + length < end && !is_json_space(s[length]) && !is_index_op(s[length]))) {
+		ip->malformed = 1;
+		return 0;
+	}
+
+	if (!literal) {
+		return ip->cb->yajl_number(ip->ctx, (const char *)(s), length);
+	} else if (*s == 'n') {
+		return ip->cb->yajl_null(ip->ctx);
+	} else {
+		return ip->cb->yajl_boolean(ip->ctx, *s == 't');
+	}
+}
+
+static int index_open(IndexParser *ip, int is_map)
+{
+	if (ip->depth == ip->capacity) {
+		size_t capacity = ip->capacity ? 2 * ip->capacity : 64;
+		unsigned char *stack = realloc(ip->stack, capacity);
+
+		if (stack == NULL) {
+			ip->malformed = 1; // YAJL reports running out of memory
+			return 0;
+		}
+
+		ip->stack = stack;
+		ip->capacity = capacity;
+	}
+
+	ip->stack[ip->depth++] = is_map;
+	ip->opened = 1;
+
+	return is_map ? ip->cb->yajl_start_map(ip->ctx) : ip->cb->yajl_start_array(ip->ctx);
+}
+
+static int index_close(IndexParser *ip)
+{
+	int is_map = ip->stack[--ip->depth];
+	return is_map ? ip->cb->yajl_end_map(ip->ctx) : ip->cb->yajl_end_array(ip->ctx);
+}
+
+static int index_value(IndexParser *ip, size_t pos)
+{
+	const unsigned char *str;
+	size_t length;
+
+	switch (ip->index.json[pos]) {
+	case '{':
+		return index_open(ip, 1);
+	case '[':
+		return index_open(ip, 0);
+	case '"':
+		return index_string(ip, pos, &str, &length) && ip->cb->yajl_string(ip->ctx, str, length);
+	case '}':
+	case ']':
+	case ':':
+	case ',':
+		ip->malformed = 1;
+		return 0;
+	default:
+		return index_scalar(ip, pos);
+	}
+}
+
+// Parses a single document, calling 'cb' like yajl_parse() would. Returns
+// yajl_status_client_canceled if a callback returned 0, and
+// yajl_status_error if the fast path gave up.
+static yajl_status index_parse(
+	const unsigned char *json,
+	size_t length,
+	const yajl_callbacks *cb,
+	void *ctx
+)
+{
+	IndexParser *ip = calloc(1, sizeof *ip); // too large for the stack
+
+	if (ip == NULL) {
+		return yajl_status_error;
+	}
+
+	pthread_once(&classify_once, classify_select);
+
+	ip->index.json = json;
+	ip->index.length = length;
+	ip->cb = cb;
+	ip->ctx = ctx;
+
+	size_t pos = index_next(&ip->index);
+	int ok = 0;
+
+	if (pos == SIZE_MAX) {
+		ip->malformed = 1;
+	} else {
+		ok = index_value(ip, pos);
+	}
+
+	while (ok && ip->depth > 0) {
+		int is_map = ip->stack[ip->depth - 1];
+		int opened = ip->opened;
+
+		ip->opened = 0;
+		pos = index_next(&ip->index);
+
+		if (pos != SIZE_MAX && ip->index.json[pos] == (is_map ? '}' : ']')) {
+			ok = index_close(ip);
+			continue;
+		}
+
+		// the next element: either the first one, or one after a comma
+		if (pos != SIZE_MAX && !opened) {
+			pos = ip->index.json[pos] == ',' ? index_next(&ip->index) : SIZE_MAX;
+		}
+
+		if (pos != SIZE_MAX && is_map) {
+			const unsigned char *key;
+			size_t keylen;
+
+			if (ip->index.json[pos] != '"' || !index_string(ip, pos, &key, &keylen)) {
+				ip->malformed = 1;
+				break;
+			}
+
+			if (!cb->yajl_map_key(ctx, key, keylen)) {
+				ok = 0;
+				break;
+			}
+
+			pos = index_next(&ip->index);
+			pos = pos != SIZE_MAX && ip->index.json[pos] == ':' ? index_next(&ip->index) : SIZE_MAX;
+		}
+
+		if (pos == SIZE_MAX) {
+			ip->malformed = 1;
+			break;
+		}
+
+		ok = index_value(ip, pos);
+	}
+
+	// nothing but whitespace may follow the document
+	if (ok && index_next(&ip->index) != SIZE_MAX) {
+		ip->malformed = 1;
+	}
+
+	yajl_status status;
+
+	if (ip->malformed || ip->index.invalid) {
+		status = yajl_status_error;
+	} else {
+		status = ok ? yajl_status_ok : yajl_status_client_canceled;
+	}
+
+	free(ip->stack);
+	free(ip->buf);
+	free(ip);
+
+	return status;
+}
+
+static int index_applicable(const ParserOptions *options)
+{
+	// comments would be taken for scalars
+	return !options->lines && !(options->yajl_flags & yajl_allow_comments);
+}
+
+// Parses a complete input with the fast path, or with YAJL if that
+// gives up
+static int parse_indexed(
+	PooledParser *parser,
+	const ParserOptions *options,
+	const unsigned char *json,
+	size_t length,
+	SpnValue *ret,
+	SpnContext *ctx
+)
+{
+	ParserState *state = &parser->state;
+	state->ctx = ctx;
+
+	yajl_status status = index_parse(json, length, &parser_callbacks, state);
+
+	if (status == yajl_status_ok || (status == yajl_status_client_canceled && state->stopped)) {
+		if (state->stopped) {
+			state_unwind(state);
+		}
+
+		parser_take_result(parser, ret);
+		return 0;
+	}
+
+	// start over; YAJL also finds the error, if there's one
+	state_reset(state);
+	parser_configure(parser, options);
+
+	return parse_serial(parser, json, length, ret, ctx);
+}
+
+/*
+ * Lazy documents
+ *
+ * With the 'lazy' option, a document is only parsed into a Tape, which
+ * is wrapped in a LazyDocument object. Values are built on demand by
+ * YAJL["get"], which locates the requested subtree on the tape and
+ * replays just that part into a ParserState. The document keeps the
+ * source string alive, since the tape refers to strings in it, and
+ * caches the values built by get().
+ */
+
+typedef struct LazyDocument {
+	SpnObject base;
+	Tape tape;
+	SpnValue source; // the JSON text
+	SpnValue cache; // index of the first word of a value -> value
+	int explicit_null;
+	int raw_numbers;
+	int cache_keys;
+	int dedup_strings;
+} LazyDocument;
+
+static void lazy_document_dtor(void *obj)
+{
+	LazyDocument *doc = obj;
+	tape_free(&doc->tape);
+	spn_value_release(&doc->source);
+	spn_value_release(&doc->cache);
+}
+
+static const SpnClass LazyDocument_class = {
+	.instsz     = sizeof(LazyDocument),
+	.equal      = NULL,
+	.compare    = NULL,
+	.hashfn     = NULL,
+	.destructor = lazy_document_dtor
+};
+
+// Handles building tapes on the calling thread allocate from this arena
+static THREAD_LOCAL Arena tape_arena = { NULL };
+
+// Parses a single document into 'tape'. Returns 0 on success;
+// errors are reported on 'ctx'.
+static int tape_parse(
+	Tape *tape,
+	const unsigned char *json,
+	size_t length,
+	unsigned yajl_flags,
+	int raw_numbers,
+	SpnContext *ctx
+)
+{
+	TapeBuilder builder = tape_builder_init(tape, raw_numbers);
+	thread_cache_register();
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&tape_arena);
+	yajl_handle hndl = yajl_alloc(&tape_callbacks, &alloc_funcs, &builder);
+	config_handle_flags(hndl, yajl_flags);
+
+	int rv = 0;
+	yajl_status status = yajl_parse(hndl, json, length);
+
+	if (status == yajl_status_ok) {
+		status = yajl_complete_parse(hndl);
+	}
+
+	if (status != yajl_status_ok) {
+		if (tape->failed || builder.error) {
+			const void *args[1] = { tape->failed ? "out of memory" : builder.error };
+			spn_ctx_runtime_error(ctx, "error parsing JSON: %s", args);
+		} else {
+			error_message_to_spn_context(hndl, ctx, json, length);
+		}
+
+		rv = -4;
+	}
+
+	yajl_free(hndl);
+	arena_reset(&tape_arena);
+	tape_builder_free(&builder);
+
+	return rv;
+}
+
+// Returns the name of an option that doesn't work with lazy documents,
+// or NULL if there's none
+static const char *lazy_unsupported_option(const ParserOptions *options)
+{
+	if (options->lines) {
+		return "lines";
+	}
+
+	if (!spn_isnil(&options->each)) {
+		return "each";
+	}
+
+	if (!spn_isnil(&options->fields)) {
+		return "fields";
+	}
+
+	if (options->limit > 0) {
+		return "limit";
+	}
+
+	if (!spn_isnil(&options->stop_after_path)) {
+		return "stop_after_path";
+	}
+
+	if (options->threads > 1) {
+		return "threads";
+	}
+
+	return NULL;
+}
+
+// 'source' is the string to be parsed. 'what' names the caller in error
+// messages (the 'lazy' option or parse_tape).
+static int parse_lazy(
+	const ParserOptions *options,
+	SpnValue source,
+	const char *what,
+	SpnValue *ret,
+	SpnContext *ctx
+)
+{
+	const char *unsupported = lazy_unsupported_option(options);
+
+	if (unsupported) {
+		const void *args[2] = { unsupported, what };
+		spn_ctx_runtime_error(ctx, "option '%s' can't be used with %s", args);
+		return -6;
+	}
+
+	SpnString *strobj = spn_stringvalue(&source);
+	const unsigned char *json = (const unsigned char *)(strobj->cstr);
+	size_t length = strobj->len;
+
+	LazyDocument *doc = spn_object_new(&LazyDocument_class);
+	doc->tape = tape_init();
+	doc->tape.source = json;
+	doc->tape.source_length = length;
+	doc->source = source;
+	doc->cache = spn_makehashmap();
+	doc->explicit_null = options->explicit_null;
+	doc->raw_numbers = options->raw_numbers;
+	doc->cache_keys = options->cache_keys;
+	doc->dedup_strings = options->dedup_strings;
+
+	spn_value_retain(&doc->source);
+
+	SpnValue docval = spn_makestrguserinfo(doc);
+	int rv = tape_parse(&doc->tape, json, length, options->yajl_flags, options->raw_numbers, ctx);
+
+	if (rv == 0) {
+		*ret = docval;
+	} else {
+		spn_value_release(&docval);
+	}
+
+	return rv;
+}
+
+// Returns the index of the word after the value starting at word 'i'
+static size_t tape_skip(const Tape *tape, size_t i)
+{
+	uint64_t word = tape->words[i];
+
+	switch (TAPE_TAG(word)) {
+	case TAPE_INT:
+	case TAPE_DOUBLE:
+	case TAPE_STRING:
+	case TAPE_KEY:
+	case TAPE_NUMBER:
+		return i + 2;
+	case TAPE_START_ARRAY:
+	case TAPE_START_MAP:
+		return TAPE_PAYLOAD(word);
+	default:
+		return i + 1;
+	}
+}
+
+// Finds the value at 'pointer'. Returns the index of its first word,
+// or SIZE_MAX if there's no such value.
+static size_t tape_lookup(const Tape *tape, const JsonPointer *pointer)
+{
+	size_t i = 0;
+
+	for (size_t t = 0; t < pointer->ntokens; t++) {
+		const PointerToken *token = &pointer->tokens[t];
+		uint64_t word = tape->words[i];
+		size_t end = TAPE_PAYLOAD(word) - 1; // the end word
+		size_t j = i + 1;
+
+		if (TAPE_TAG(word) == TAPE_START_MAP) {
+			// members are stored as a key followed by a value
+			while (j < end) {
+				const unsigned char *key = tape_string(tape, tape->words[j]);
+				size_t keylen = tape->words[j + 1];
+
+				if (keylen == token->length && memcmp(key, token->str, keylen) == 0) {
+					break;
+				}
+
+				j = tape_skip(tape, j + 2);
+			}
+
+			if (j >= end) {
+				return SIZE_MAX;
+			}
+
+			i = j + 2;
+		} else if (TAPE_TAG(word) == TAPE_START_ARRAY) {
+			if (token->index >= TAPE_PAYLOAD(tape->words[end])) {
+				return SIZE_MAX;
+			}
+
+			for (size_t k = 0; k < token->index; k++) {
+				j = tape_skip(tape, j);
+			}
+
+			i = j;
+		} else {
+			return SIZE_MAX;
+		}
+	}
+
+	return i;
+}
+
+// Builds the value starting at word 'i' into '*value'. This can only
+// fail for lack of memory (e. g. for a BigNumber), which 'ctx' is told.
+static int lazy_materialize(const LazyDocument *doc, size_t i, SpnValue *value, SpnContext *ctx)
+{
+	ParserState state = state_init();
+	state.explicit_null = doc->explicit_null;
+	state.raw_numbers = doc->raw_numbers;
+	state.keys = doc->cache_keys ? key_cache_get() : &state.local_keys;
+	state.strings = doc->dedup_strings ? &state.local_strings : NULL;
+
+	int ok = tape_replay(&doc->tape, i, tape_skip(&doc->tape, i), &parser_callbacks, &state);
+
+	if (ok) {
+		*value = state.root;
+		state.root = spn_nilval;
+	} else {
+		const void *args[1] = { state.error ? state.error : "unknown error" };
+		spn_ctx_runtime_error(ctx, "error building value: %s", args);
+	}
+
+	state_free(&state);
+
+	return ok ? 0 : -1;
+}
+
+// Like lazy_materialize(), but each value is only built once. Values
+// are shared between calls; 'nil' (for null) isn't cached.
+static int lazy_cached_value(LazyDocument *doc, size_t i, SpnValue *value, SpnContext *ctx)
+{
+	SpnHashMap *cache = spn_hashmapvalue(&doc->cache);
+	SpnValue key = spn_makeint(i);
+	*value = spn_hashmap_get(cache, &key);
+
+	if (!spn_isnil(value)) {
+		spn_value_retain(value);
+		return 0;
+	}
+
+	if (lazy_materialize(doc, i, value, ctx) != 0) {
+		return -1;
+	}
+
+	spn_hashmap_set(cache, &key, value);
+
+	return 0;
+}
+
+static LazyDocument *lazy_document_arg(SpnValue *arg, SpnContext *ctx)
+{
+	if (!spn_isstrguserinfo(arg) || spn_objvalue(arg)->isa != &LazyDocument_class) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a lazy document", NULL);
+		return NULL;
+	}
+
+	return (LazyDocument *)(spn_objvalue(arg));
+}
+
+// Parses the optional JSON Pointer argument and finds its value.
+// Returns 0 on success, setting '*index' to SIZE_MAX if not found.
+static int lazy_lookup_arg(
+	LazyDocument *doc,
+	int argc,
+	SpnValue argv[],
+	size_t *index,
+	SpnContext *ctx
+)
+{
+	if (argc < 2) {
+		*index = 0;
+		return 0;
+	}
+
+	if (!spn_isstring(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a JSON pointer", NULL);
+		return -3;
+	}
+
+	SpnString *str = spn_stringvalue(&argv[1]);
+	JsonPointer pointer;
+	int ok = pointer_parse(&pointer, str->cstr, str->len);
+
+	if (ok) {
+		*index = tape_lookup(&doc->tape, &pointer);
+	} else {
+		const void *args[1] = { str->cstr };
+		spn_ctx_runtime_error(ctx, "invalid JSON pointer '%s'", args);
+	}
+
+	pointer_free(&pointer);
+
+	return ok ? 0 : -3;
+}
+
+static int json_get(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	LazyDocument *doc = lazy_document_arg(&argv[0], ctx);
+	if (doc == NULL) {
+		return -2;
+	}
+
+	size_t index;
+	int rv = lazy_lookup_arg(doc, argc, argv, &index, ctx);
+
+	if (rv == 0 && index != SIZE_MAX && lazy_cached_value(doc, index, ret, ctx) != 0) {
+		rv = -4;
+	}
+
+	return rv;
+}
+
+static int json_parse_tape(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!spn_isstring(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a string", NULL);
+		return -2;
+	}
+
+	if (argc >= 2 && !spn_ishashmap(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a config object", NULL);
+		return -3;
+	}
+
+	ParserOptions options = default_parser_options();
+
+	if (argc >= 2) {
+		config_parser(&options, argv[1]);
+	}
+
+	return parse_lazy(&options, argv[0], "parse_tape", ret, ctx);
+}
+
+// Returns the index of the end word of the container at word 'i',
+// or SIZE_MAX if the value at 'i' isn't a container
+static size_t tape_container_end(const Tape *tape, size_t i)
+{
+	int tag = TAPE_TAG(tape->words[i]);
+
+	if (tag != TAPE_START_ARRAY && tag != TAPE_START_MAP) {
+		return SIZE_MAX;
+	}
+
+	return TAPE_PAYLOAD(tape->words[i]) - 1;
+}
+
+static int json_tape_length(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	LazyDocument *doc = lazy_document_arg(&argv[0], ctx);
+	if (doc == NULL) {
+		return -2;
+	}
+
+	size_t index;
+	int rv = lazy_lookup_arg(doc, argc, argv, &index, ctx);
+
+	if (rv == 0 && index != SIZE_MAX) {
+		size_t end = tape_container_end(&doc->tape, index);
+
+		if (end != SIZE_MAX) {
+			*ret = spn_makeint(TAPE_PAYLOAD(doc->tape.words[end]));
+		}
+	}
+
+	return rv;
+}
+
+static int json_tape_keys(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	LazyDocument *doc = lazy_document_arg(&argv[0], ctx);
+	if (doc == NULL) {
+		return -2;
+	}
+
+	size_t index;
+	int rv = lazy_lookup_arg(doc, argc, argv, &index, ctx);
+
+	if (rv != 0 || index == SIZE_MAX || TAPE_TAG(doc->tape.words[index]) != TAPE_START_MAP) {
+		return rv;
+	}
+
+	const Tape *tape = &doc->tape;
+	size_t end = tape_container_end(tape, index);
+	InternTable local_keys = { NULL, 0, 0 };
+	InternTable *keys = doc->cache_keys ? key_cache_get() : &local_keys;
+	SpnValue result = spn_makearray();
+
+	for (size_t j = index + 1; j < end; j = tape_skip(tape, j + 2)) {
+		const unsigned char *key = tape_string(tape, tape->words[j]);
+		SpnValue keyval = intern_string(keys, key, tape->words[j + 1]);
+
+		spn_array_push(spn_arrayvalue(&result), &keyval);
+		spn_value_release(&keyval);
+	}
+
+	intern_free(&local_keys);
+	*ret = result;
+
+	return 0;
+}
+
+// Calls a function with the index (or key) and value of each element
+// of an array (or object). Each value is built just for the call.
+static int json_tape_iterate(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc != 3) {
+		spn_ctx_runtime_error(ctx, "expecting 3 arguments", NULL);
+		return -1;
+	}
+
+	LazyDocument *doc = lazy_document_arg(&argv[0], ctx);
+	if (doc == NULL) {
+		return -2;
+	}
+
+	if (!spn_isfunc(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "3rd argument must be a function", NULL);
+		return -3;
+	}
+
+	size_t index;
+	int rv = lazy_lookup_arg(doc, 2, argv, &index, ctx);
+
+	if (rv != 0 || index == SIZE_MAX) {
+		return rv;
+	}
+
+	const Tape *tape = &doc->tape;
+	size_t end = tape_container_end(tape, index);
+
+	if (end == SIZE_MAX) {
+		return 0;
+	}
+
+	int is_map = TAPE_TAG(tape->words[index]) == TAPE_START_MAP;
+	InternTable local_keys = { NULL, 0, 0 };
+	InternTable *keys = doc->cache_keys ? key_cache_get() : &local_keys;
+	long n = 0;
+	size_t j = index + 1;
+
+	while (j < end) {
+		SpnValue args[2];
+
+		if (is_map) {
+			const unsigned char *key = tape_string(tape, tape->words[j]);
+			args[0] = intern_string(keys, key, tape->words[j + 1]);
+			j += 2;
+		} else {
+			args[0] = spn_makeint(n);
+		}
+
+		if (lazy_materialize(doc, j, &args[1], ctx) != 0) {
+			spn_value_release(&args[0]);
+			rv = -5;
+			break;
+		}
+
+		j = tape_skip(tape, j);
+		n++;
+
+		SpnValue cbret = spn_nilval;
+		int error = spn_ctx_callfunc(ctx, spn_funcvalue(&argv[2]), &cbret, 2, args);
+		int stop = spn_isbool(&cbret) && !spn_boolvalue(&cbret);
+
+		spn_value_release(&args[0]);
+		spn_value_release(&args[1]);
+		spn_value_release(&cbret);
+
+		if (error) {
+			rv = -4;
+			break;
+		}
+
+		if (stop) {
+			break;
+		}
+	}
+
+	intern_free(&local_keys);
+
+	return rv;
+}
+
+static int parse_string(SpnValue *ret, int argc, SpnValue argv[], SpnContext *ctx, int lines)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!spn_isstring(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a string", NULL);
+		return -2;
+	}
+
+	if (argc >= 2 && !spn_ishashmap(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a config object", NULL);
+		return -3;
+	}
+
+	SpnString *strobj = spn_stringvalue(&argv[0]);
+	const unsigned char *str = (const unsigned char *)(strobj->cstr);
+	size_t length = strobj->len;
+	int rv = 0;
+
+	ParserOptions options = default_parser_options();
+
+	if (argc >= 2) {
+		config_parser(&options, argv[1]);
+	}
+
+	options.lines |= lines;
+
+	if (options.lazy) {
+		return parse_lazy(&options, argv[0], "'lazy'", ret, ctx);
+	}
+
+	PooledParser *parser = parser_acquire(&options);
+
+	if (parallel_applicable(&options, length)) {
+		rv = parse_parallel(parser, &options, str, length, ret, ctx);
+	} else if (index_applicable(&options)) {
+		rv = parse_indexed(parser, &options, str, length, ret, ctx);
+	} else {
+		rv = parse_serial(parser, str, length, ret, ctx);
+	}
+
+	parser_release(parser, rv == 0);
+
+	return rv;
+}
+
+static int json_parse(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	return parse_string(ret, argc, argv, ctx, 0);
+}
+
+static int json_parse_lines(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	return parse_string(ret, argc, argv, ctx, 1);
+}
+
+/*
+ * Parsing files
+ */
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+// Passes the contents of the file at 'path' to 'fn'. Regular files are
+// memory-mapped and passed in one piece (with 'whole' set); pipes and
+// other files that can't be mapped are read() in chunks. Reading stops
+// early if 'fn' returns nonzero.
+// Returns 0 on success or an errno value on I/O error.
+static int read_file_chunks(
+	const char *path,
+	int (*fn)(void *ctx, const unsigned char *data, size_t length, int whole),
+	void *fnctx
+)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return errno;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int error = errno;
+		close(fd);
+		return error;
+	}
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		size_t size = st.st_size;
+		void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (map != MAP_FAILED) {
+			close(fd);
+			posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+			fn(fnctx, map, size, 1);
+			munmap(map, size);
+			return 0;
+		}
+	}
+
+	unsigned char *buf = malloc(READ_CHUNK_SIZE);
+	int error = 0;
+
+	if (buf == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	while (1) {
+		ssize_t n = read(fd, buf, READ_CHUNK_SIZE);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n < 0) {
+			error = errno;
+			break;
+		}
+
+		if (n == 0 || fn(fnctx, buf, n, 0) != 0) {
+			break;
+		}
+	}
+
+	free(buf);
+	close(fd);
+
+	return error;
+}
+
+typedef struct FileParse {
+	PooledParser *parser;
+	const ParserOptions *options;
+	SpnValue *ret;
+	SpnContext *ctx;
+	int rv;
+	int completed; // already parsed to the end, '*ret' is set
+} FileParse;
+
+static int parse_file_chunk(void *ctx, const unsigned char *data, size_t length, int whole)
+{
+	FileParse *fp = ctx;
+
+	if (whole && parallel_applicable(fp->options, length)) {
+		fp->rv = parse_parallel(fp->parser, fp->options, data, length, fp->ret, fp->ctx);
+		fp->completed = 1;
+	} else if (whole && index_applicable(fp->options)) {
+		fp->rv = parse_indexed(fp->parser, fp->options, data, length, fp->ret, fp->ctx);
+		fp->completed = 1;
+	} else {
+		fp->rv = parser_feed(fp->parser, data, length, fp->ctx);
+	}
+
+	// no need to read any further after a stop
+	return fp->rv != 0 || fp->parser->state.stopped;
+}
+
+static int json_parse_file(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!spn_isstring(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a file path", NULL);
+		return -2;
+	}
+
+	if (argc >= 2 && !spn_ishashmap(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a config object", NULL);
+		return -3;
+	}
+
+	const char *path = spn_stringvalue(&argv[0])->cstr;
+	ParserOptions options = default_parser_options();
+
+	if (argc >= 2) {
+		config_parser(&options, argv[1]);
+	}
+
+	PooledParser *parser = parser_acquire(&options);
+	FileParse fp = {
+		.parser = parser,
+		.options = &options,
+		.ret = ret,
+		.ctx = ctx,
+		.rv = 0,
+		.completed = 0
+	};
+
+	int error = read_file_chunks(path, parse_file_chunk, &fp);
+	int rv = fp.rv;
+
+	if (rv == 0 && error != 0) {
+		const void *args[2] = { path, strerror(error) };
+		spn_ctx_runtime_error(ctx, "cannot read file '%s': %s", args);
+		rv = -6;
+	}
+
+	if (rv == 0 && !fp.completed) {
+		rv = parser_complete(parser, ret, ctx, NULL, 0);
+	}
+
+	parser_release(parser, rv == 0);
+
+	return rv;
+}
+
+/*
+ * Validation
+ */
+
+// Validating handles allocate from this arena. Numbers are the only
+// values looked at, for the same range checks as parsing does; nothing
+// else is built or allocated.
+static THREAD_LOCAL Arena validator_arena = { NULL };
+
+typedef struct Validator {
+	int raw_numbers;
+	const char *error; // set by vb_number() when it cancels the parse
+} Validator;
+
+static int vb_number(void *ctx, const char *numval, size_t length)
+{
+	Validator *validator = ctx;
+	ParsedNumber number;
+	const char *error = number_parse(numval, length, &number);
+
+	if (error && !(number_out_of_range(error) && validator->raw_numbers)) {
+		validator->error = error;
+		return 0;
+	}
+
+	return 1;
+}
+
+static const yajl_callbacks validator_callbacks = {
+	.yajl_null        = NULL,
+	.yajl_boolean     = NULL,
+	.yajl_integer     = NULL,
+	.yajl_double      = NULL,
+	.yajl_number      = vb_number,
+	.yajl_string      = NULL,
+	.yajl_start_map   = NULL,
+	.yajl_map_key     = NULL,
+	.yajl_end_map     = NULL,
+	.yajl_start_array = NULL,
+	.yajl_end_array   = NULL
+};
+
+static int json_validate(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	if (!spn_isstring(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a string", NULL);
+		return -2;
+	}
+
+	if (argc >= 2 && !spn_ishashmap(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a config object", NULL);
+		return -3;
+	}
+
+	SpnString *strobj = spn_stringvalue(&argv[0]);
+	const unsigned char *str = (const unsigned char *)(strobj->cstr);
+	size_t length = strobj->len;
+	ParserOptions options = default_parser_options();
+
+	if (argc >= 2) {
+		config_parser(&options, argv[1]);
+	}
+
+	if (options.lines) {
+		options.yajl_flags |= yajl_allow_multiple_values;
+	}
+
+	Validator validator = { options.raw_numbers, NULL };
+
+	thread_cache_register();
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&validator_arena);
+	yajl_handle hndl = yajl_alloc(&validator_callbacks, &alloc_funcs, &validator);
+	config_handle_flags(hndl, options.yajl_flags);
+
+	size_t offset = length;
+	int valid = yajl_parse(hndl, str, length) == yajl_status_ok;
+
+	if (!valid) {
+		offset = yajl_get_bytes_consumed(hndl);
+	} else if (!options.lines || !json_is_blank(str, length)) {
+		// with 'lines', empty input is no documents, as in parse_lines()
+		valid = yajl_complete_parse(hndl) == yajl_status_ok;
+	}
+
+	SpnValue result = spn_makehashmap();
+	SpnHashMap *hm = spn_hashmapvalue(&result);
+	SpnValue validval = spn_makebool(valid);
+	spn_hashmap_set_strkey(hm, "valid", &validval);
+
+	if (!valid) {
+		unsigned char *errmsg = yajl_get_error(hndl, 0, str, length);
+		size_t errlen = strlen((const char *)(errmsg));
+
+		// YAJL terminates the message with a newline
+		while (errlen > 0 && is_json_space(errmsg[errlen - 1])) {
+			errlen--;
+		}
+
+		SpnValue offsetval = spn_makeint(offset);
+		SpnValue errorval;
+
+		if (validator.error) {
+			// worded like YAJL's own number errors
+			char numerrmsg[64] = "parse error: ";
+			strcat(numerrmsg, validator.error);
+			errorval = spn_makestring(numerrmsg);
+		} else {
+			errorval = spn_makestring_len((const char *)(errmsg), errlen);
+		}
+
+		spn_hashmap_set_strkey(hm, "offset", &offsetval);
+		spn_hashmap_set_strkey(hm, "error", &errorval);
+		spn_value_release(&errorval);
+
+		yajl_free_error(hndl, errmsg);
+	}
+
+	yajl_free(hndl);
+	arena_reset(&validator_arena);
+
+	*ret = result;
+
+	return 0;
+}
+
+/*
+ * Path extraction
+ *
+ * Only the values at the requested JSON Pointers (RFC 6901) are built.
+ * The current path is tracked on a stack of ExtractLevels, subtrees which
+ * contain none of the targets are skipped, and parsing stops as soon as
+ * every target has been found.
+ */
+
+typedef struct ExtractTarget {
+	SpnValue pointer; // borrowed; the key in the resulting hashmap
+	JsonPointer path;
+	int found; // found, or known to be missing
+} ExtractTarget;
+
+typedef struct ExtractLevel {
+	int is_array;
+	size_t count; // number of elements seen so far, for arrays
+	char *key; // current key, for objects
+	size_t keylen;
+	size_t keycap;
+} ExtractLevel;
+
+typedef struct Extractor {
+	ExtractTarget *targets;
+	size_t ntargets;
+	size_t remaining; // targets not yet found
+	ExtractLevel *levels;
+	size_t depth;
+	size_t capacity;
+	size_t skip; // nesting depth inside a skipped value
+	int capturing; // events are building the value in 'value'
+	ParserState value;
+	SpnValue result;
+} Extractor;
+
+// Extracting handles are cancelled once everything has been found,
+// so they can't be reused; they allocate from this arena instead.
+static THREAD_LOCAL Arena extract_arena = { NULL };
+
+static void extractor_free(Extractor *ex)
+{
+	for (size_t i = 0; i < ex->ntargets; i++) {
+		pointer_free(&ex->targets[i].path);
+	}
+
+	for (size_t i = 0; i < ex->capacity; i++) {
+		free(ex->levels[i].key);
+	}
+
+	free(ex->targets);
+	free(ex->levels);
+	state_free(&ex->value);
+	spn_value_release(&ex->result);
+}
+
+// Returns the index of the first malformed pointer, or SIZE_MAX
+static size_t extractor_init(Extractor *ex, SpnArray *pointers, const ParserOptions *options)
+{
+	size_t n = spn_array_count(pointers);
+
+	ex->targets = calloc(n ? n : 1, sizeof ex->targets[0]);
+	ex->ntargets = 0;
+	ex->remaining = n;
+	ex->levels = NULL;
+	ex->depth = 0;
+	ex->capacity = 0;
+	ex->skip = 0;
+	ex->capturing = 0;
+	ex->value = state_init();
+	ex->value.keys = &ex->value.local_keys;
+	ex->value.explicit_null = options->explicit_null;
+	ex->value.raw_numbers = options->raw_numbers;
+	ex->result = spn_makehashmap();
+
+	for (size_t i = 0; i < n; i++) {
+		ExtractTarget *target = &ex->targets[ex->ntargets];
+		SpnValue pointer = spn_array_get(pointers, i);
+
+		if (!spn_isstring(&pointer)) {
+			return i;
+		}
+
+		SpnString *str = spn_stringvalue(&pointer);
+		int ok = pointer_parse(&target->path, str->cstr, str->len);
+		ex->ntargets++; // so that its tokens are freed
+
+		if (!ok) {
+			return i;
+		}
+
+		target->pointer = pointer;
+		target->found = 0;
+	}
+
+	return SIZE_MAX;
+}
+
+static int extract_token_matches(const ExtractLevel *level, const PointerToken *token)
+{
+	if (level->is_array) {
+		return token->index == level->count - 1;
+	}
+
+	return token->length == level->keylen && memcmp(token->str, level->key, token->length) == 0;
+}
+
+// Whether the first 'depth' levels of the current path are a prefix of
+// (or equal to) the target
+static int extract_matches(const Extractor *ex, const ExtractTarget *target, size_t depth)
+{
+	if (target->found || target->path.ntokens < depth) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < depth; i++) {
+		if (!extract_token_matches(&ex->levels[i], &target->path.tokens[i])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int extract_on_path(const Extractor *ex, const ExtractTarget *target)
+{
+	return extract_matches(ex, target, ex->depth);
+}
+
+// Marks the targets below the first 'depth' levels of the current path
+// as missing. Called when that path leads to a container which is being
+// closed, or to a scalar: what hasn't been found in there doesn't exist.
+static void extract_missing(Extractor *ex, size_t depth)
+{
+	for (size_t i = 0; i < ex->ntargets; i++) {
+		ExtractTarget *target = &ex->targets[i];
+
+		if (target->path.ntokens > depth && extract_matches(ex, target, depth)) {
+			target->found = 1;
+			ex->remaining--;
+		}
+	}
+}
+
+static void extract_push(Extractor *ex, int is_array)
+{
+	if (ex->depth == ex->capacity) {
+		size_t capacity = ex->capacity ? 2 * ex->capacity : STATE_STACK_INITIAL_CAPACITY;
+		ex->levels = realloc(ex->levels, capacity * sizeof ex->levels[0]);
+		memset(ex->levels + ex->capacity, 0, (capacity - ex->capacity) * sizeof ex->levels[0]);
+		ex->capacity = capacity;
+	}
+
+	ExtractLevel *level = &ex->levels[ex->depth++];
+	level->is_array = is_array;
+	level->count = 0;
+	level->keylen = 0;
+}
+
+// Looks up the rest of a target within an already built value
+static int extract_lookup(SpnValue value, const ExtractTarget *target, size_t from, SpnValue *out)
+{
+	for (size_t i = from; i < target->path.ntokens; i++) {
+		const PointerToken *token = &target->path.tokens[i];
+
+		if (spn_ishashmap(&value)) {
+			value = spn_hashmap_get_strkey(spn_hashmapvalue(&value), token->str);
+		} else if (spn_isarray(&value) && token->index < spn_array_count(spn_arrayvalue(&value))) {
+			value = spn_array_get(spn_arrayvalue(&value), token->index);
+		} else {
+			return 0;
+		}
+	}
+
+	*out = value;
+	return 1;
+}
+
+// The captured value is complete. It is stored for every target at the
+// current path; targets inside of it are looked up in the built value.
+// Returns 0 (cancelling the parse) once every target has been found.
+static int extract_finish_value(Extractor *ex)
+{
+	SpnHashMap *result = spn_hashmapvalue(&ex->result);
+	SpnValue value = ex->value.root;
+
+	for (size_t i = 0; i < ex->ntargets; i++) {
+		ExtractTarget *target = &ex->targets[i];
+		SpnValue member;
+
+		if (!extract_on_path(ex, target)) {
+			continue;
+		}
+
+		if (extract_lookup(value, target, ex->depth, &member)) {
+			spn_hashmap_set(result, &target->pointer, &member);
+		}
+
+		target->found = 1;
+		ex->remaining--;
+	}
+
+	state_reset(&ex->value);
+	ex->capturing = 0;
+
+	return ex->remaining > 0;
+}
+
+// Handles an event outside of captured values. 'nesting' is 1 for the
+// start of a collection, -1 for its end and 0 for scalars.
+// Returns nonzero if the event is to be passed on to 'value'.
+static int extract_event(Extractor *ex, int nesting, int is_array)
+{
+	if (ex->capturing) {
+		return 1;
+	}
+
+	if (ex->skip > 0) {
+		ex->skip += nesting;
+		return 0;
+	}
+
+	if (nesting < 0) {
+		extract_missing(ex, ex->depth - 1);
+		ex->depth--;
+		return 0;
+	}
+
+	ExtractLevel *top = ex->depth ? &ex->levels[ex->depth - 1] : NULL;
+	int descend = 0;
+
+	if (top && top->is_array) {
+		top->count++;
+	}
+
+	for (size_t i = 0; i < ex->ntargets; i++) {
+		const ExtractTarget *target = &ex->targets[i];
+
+		if (extract_on_path(ex, target)) {
+			if (target->path.ntokens == ex->depth) {
+				ex->capturing = 1;
+				return 1;
+			}
+
+			descend = 1;
+		}
+	}
+
+	if (nesting > 0) {
+		if (descend) {
+			extract_push(ex, is_array);
+		} else {
+			ex->skip = 1;
+		}
+	} else if (descend) {
+		// targets go through this scalar
+		extract_missing(ex, ex->depth);
+	}
+
+	return 0;
+}
+
+// The callbacks return this for events outside of captured values:
+// the parse is cancelled once every target is found or known missing.
+static int extract_continue(const Extractor *ex)
+{
+	return ex->remaining > 0;
+}
+
+// Checks whether the value being captured is complete
+static int extract_forward(Extractor *ex, int rv)
+{
+	if (rv && ex->value.depth == 0) {
+		return extract_finish_value(ex);
+	}
+
+	return rv;
+}
+
+static int ex_null(void *ctx)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, 0, 0) ? extract_forward(ex, cb_null(&ex->value)) : extract_continue(ex);
+}
+
+static int ex_boolean(void *ctx, int boolval)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, 0, 0) ? extract_forward(ex, cb_boolean(&ex->value, boolval)) : extract_continue(ex);
+}
+
+static int ex_integer(void *ctx, long long intval)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, 0, 0) ? extract_forward(ex, cb_integer(&ex->value, intval)) : extract_continue(ex);
+}
+
+static int ex_double(void *ctx, double doubleval)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, 0, 0) ? extract_forward(ex, cb_double(&ex->value, doubleval)) : extract_continue(ex);
+}
+
+static int ex_number(void *ctx, const char *numval, size_t length)
+{
+	Extractor *ex = ctx;
+	ParsedNumber number;
+	const char *error = number_parse(numval, length, &number);
+
+	if (number_out_of_range(error) && ex->value.raw_numbers) {
+		return extract_event(ex, 0, 0) ? extract_forward(ex, cb_number(&ex->value, numval, length)) : extract_continue(ex);
+	}
+
+	if (error) {
+		ex->value.error = error;
+		return 0;
+	}
+
+	return number.is_integer ? ex_integer(ctx, number.intval) : ex_double(ctx, number.doubleval);
+}
+
+static int ex_string(void *ctx, const unsigned char *strval, size_t length)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, 0, 0) ? extract_forward(ex, cb_string(&ex->value, strval, length)) : extract_continue(ex);
+}
+
+static int ex_start_map(void *ctx)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, 1, 0) ? cb_start_map(&ex->value) : extract_continue(ex);
+}
+
+static int ex_map_key(void *ctx, const unsigned char *key, size_t length)
+{
+	Extractor *ex = ctx;
+
+	if (ex->capturing) {
+		return cb_map_key(&ex->value, key, length);
+	}
+
+	if (ex->skip > 0) {
+		return 1;
+	}
+
+	ExtractLevel *top = &ex->levels[ex->depth - 1];
+
+	if (length > top->keycap) {
+		top->key = realloc(top->key, length);
+		top->keycap = length;
+	}
+
+	memcpy(top->key, key, length);
+	top->keylen = length;
+
+	return 1;
+}
+
+static int ex_end_map(void *ctx)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, -1, 0) ? extract_forward(ex, cb_end_map(&ex->value)) : extract_continue(ex);
+}
+
+static int ex_start_array(void *ctx)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, 1, 1) ? cb_start_array(&ex->value) : extract_continue(ex);
+}
+
+static int ex_end_array(void *ctx)
+{
+	Extractor *ex = ctx;
+	return extract_event(ex, -1, 1) ? extract_forward(ex, cb_end_array(&ex->value)) : extract_continue(ex);
+}
+
+static const yajl_callbacks extract_callbacks = {
+	.yajl_null        = ex_null,
+	.yajl_boolean     = ex_boolean,
+	.yajl_integer     = ex_integer,
+	.yajl_double      = ex_double,
+	.yajl_number      = ex_number,
+	.yajl_string      = ex_string,
+	.yajl_start_map   = ex_start_map,
+	.yajl_map_key     = ex_map_key,
+	.yajl_end_map     = ex_end_map,
+	.yajl_start_array = ex_start_array,
+	.yajl_end_array   = ex_end_array
+};
+
+static int json_extract(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!spn_isstring(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a string", NULL);
+		return -2;
+	}
+
+	if (!spn_isarray(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be an array of JSON pointers", NULL);
+		return -3;
+	}
+
+	if (argc >= 3 && !spn_ishashmap(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "3rd argument must be a config object", NULL);
+		return -4;
+	}
+
+	SpnString *strobj = spn_stringvalue(&argv[0]);
+	const unsigned char *str = (const unsigned char *)(strobj->cstr);
+	size_t length = strobj->len;
+	ParserOptions options = default_parser_options();
+
+	if (argc >= 3) {
+		config_parser(&options, argv[2]);
+	}
+
+	Extractor ex;
+	size_t invalid = extractor_init(&ex, spn_arrayvalue(&argv[1]), &options);
+
+	if (invalid != SIZE_MAX) {
+		SpnValue pointer = spn_array_get(spn_arrayvalue(&argv[1]), invalid);
+
+		if (spn_isstring(&pointer)) {
+			const void *args[1] = { spn_stringvalue(&pointer)->cstr };
+			spn_ctx_runtime_error(ctx, "invalid JSON pointer '%s'", args);
+		} else {
+			spn_ctx_runtime_error(ctx, "JSON pointers must be strings", NULL);
+		}
+
+		extractor_free(&ex);
+		return -5;
+	}
+
+	if (ex.remaining == 0) {
+		*ret = ex.result;
+		ex.result = spn_nilval;
+		extractor_free(&ex);
+		return 0;
+	}
+
+	thread_cache_register();
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&extract_arena);
+	yajl_handle hndl = yajl_alloc(&extract_callbacks, &alloc_funcs, &ex);
+	config_handle_flags(hndl, options.yajl_flags);
+
+	int rv = 0;
+	yajl_status status = yajl_parse(hndl, str, length);
+
+	if (status == yajl_status_ok) {
+		status = yajl_complete_parse(hndl);
+	}
+
+	// cancelled because everything has been found
+	if (status == yajl_status_client_canceled && ex.remaining == 0) {
+		status = yajl_status_ok;
+	}
+
+	if (status != yajl_status_ok) {
+		if (ex.value.error) {
+			const void *args[1] = { ex.value.error };
+			spn_ctx_runtime_error(ctx, "error parsing JSON: %s", args);
+		} else {
+			error_message_to_spn_context(hndl, ctx, str, length);
+		}
+
+		rv = -6;
+	} else {
+		*ret = ex.result;
+		ex.result = spn_nilval;
+	}
+
+	yajl_free(hndl);
+	arena_reset(&extract_arena);
+	extractor_free(&ex);
+
+	return rv;
+}
+
+/*
+ * SAX-style parsing
+ *
+ * Parser events are passed to Sparkling functions instead of building
+ * a tree, so that huge documents can be processed in constant memory.
+ * To save calls into the interpreter, consecutive scalars may be passed
+ * in batches to a 'values' handler.
+ */
+
+enum {
+	SAX_START_MAP,
+	SAX_KEY,
+	SAX_END_MAP,
+	SAX_START_ARRAY,
+	SAX_END_ARRAY,
+	SAX_VALUE,
+	SAX_VALUES,
+	SAX_NUM_EVENTS
+};
+
+static const char *const sax_event_names[SAX_NUM_EVENTS] = {
+	"start_map",
+	"key",
+	"end_map",
+	"start_array",
+	"end_array",
+	"value",
+	"values"
+};
+
+#define SAX_BATCH_SIZE 256
+
+typedef struct SaxParser {
+	SpnContext *ctx;
+	SpnValue handlers[SAX_NUM_EVENTS]; // borrowed; nil if not handled
+	SpnValue batch; // scalars not yet passed to 'values'
+	InternTable local_keys;
+	InternTable *keys;
+	InternTable local_strings;
+	InternTable *strings;
+	int explicit_null;
+	int raw_numbers;
+	int stopped; // a handler returned false
+	int error_reported; // a handler raised an error
+	const char *error; // set by callbacks that cancel the parse
+} SaxParser;
+
+// Calls a handler. Returns 0 (cancelling the parse) if it failed
+// or returned false.
+static int sax_call(SaxParser *sax, int event, SpnValue *arg)
+{
+	SpnValue rv = spn_nilval;
+	int argc = arg ? 1 : 0;
+
+	if (spn_ctx_callfunc(sax->ctx, spn_funcvalue(&sax->handlers[event]), &rv, argc, arg) != 0) {
+		sax->error_reported = 1;
+		return 0;
+	}
+
+	int stop = spn_isbool(&rv) && !spn_boolvalue(&rv);
+	spn_value_release(&rv);
+
+	if (stop) {
+		sax->stopped = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int sax_flush(SaxParser *sax)
+{
+	if (spn_isnil(&sax->batch)) {
+		return 1;
+	}
+
+	// the handler may keep the array, so each batch gets a new one
+	SpnValue batch = sax->batch;
+	sax->batch = spn_nilval;
+
+	int rv = sax_call(sax, SAX_VALUES, &batch);
+	spn_value_release(&batch);
+
+	return rv;
+}
+
+// A structural event or key. Pending scalars are passed on first,
+// but only if the event is handled: they may span collections.
+static int sax_event(SaxParser *sax, int event, SpnValue *arg)
+{
+	if (spn_isnil(&sax->handlers[event])) {
+		return 1;
+	}
+
+	return sax_flush(sax) && sax_call(sax, event, arg);
+}
+
+// Consumes 'value'
+static int sax_scalar(SaxParser *sax, SpnValue value)
+{
+	int rv = 1;
+
+	if (!spn_isnil(&sax->handlers[SAX_VALUES])) {
+		if (spn_isnil(&sax->batch)) {
+			sax->batch = spn_makearray();
+		}
+
+		SpnArray *batch = spn_arrayvalue(&sax->batch);
+		spn_array_push(batch, &value);
+
+		if (spn_array_count(batch) >= SAX_BATCH_SIZE) {
+			rv = sax_flush(sax);
+		}
+	} else if (!spn_isnil(&sax->handlers[SAX_VALUE])) {
+		rv = sax_call(sax, SAX_VALUE, &value);
+	}
+
+	spn_value_release(&value);
+
+	return rv;
+}
+
+static int sax_null(void *ctx)
+{
+	SaxParser *sax = ctx;
+	SpnValue nullrepr = sax->explicit_null ? null_value : spn_nilval;
+	return sax_scalar(sax, nullrepr);
+}
+
+static int sax_boolean(void *ctx, int boolval)
+{
+	return sax_scalar(ctx, spn_makebool(boolval));
+}
+
+static int sax_integer(void *ctx, long long intval)
+{
+	return sax_scalar(ctx, spn_makeint(intval));
+}
+
+static int sax_double(void *ctx, double doubleval)
+{
+	return sax_scalar(ctx, spn_makefloat(doubleval));
+}
+
+static int sax_number(void *ctx, const char *numval, size_t length)
+{
+	SaxParser *sax = ctx;
+	ParsedNumber number;
+	const char *error = number_parse(numval, length, &number);
+
+	if (number_out_of_range(error) && sax->raw_numbers) {
+		SpnValue big = big_number_new(numval, length);
+
+		if (spn_isnil(&big)) {
+			sax->error = number_no_memory;
+			return 0;
+		}
+
+		return sax_scalar(sax, big);
+	}
+
+	if (error) {
+		sax->error = error;
+		return 0;
+	}
+
+	return sax_scalar(sax, number.is_integer ? spn_makeint(number.intval) : spn_makefloat(number.doubleval));
+}
+
+static int sax_string(void *ctx, const unsigned char *strval, size_t length)
+{
+	SaxParser *sax = ctx;
+	SpnValue value;
+
+	if (sax->strings) {
+		value = intern_string(sax->strings, strval, length);
+	} else {
+		value = spn_makestring_len((const char *)(strval), length);
+	}
+
+	return sax_scalar(sax, value);
+}
+
+static int sax_start_map(void *ctx)
+{
+	return sax_event(ctx, SAX_START_MAP, NULL);
+}
+
+static int sax_map_key(void *ctx, const unsigned char *key, size_t length)
+{
+	SaxParser *sax = ctx;
+
+	if (spn_isnil(&sax->handlers[SAX_KEY])) {
+		return sax_event(sax, SAX_KEY, NULL);
+	}
+
+	SpnValue keyval = intern_string(sax->keys, key, length);
+	int rv = sax_event(sax, SAX_KEY, &keyval);
+	spn_value_release(&keyval);
+
+	return rv;
+}
+
+static int sax_end_map(void *ctx)
+{
+	return sax_event(ctx, SAX_END_MAP, NULL);
+}
+
+static int sax_start_array(void *ctx)
+{
+	return sax_event(ctx, SAX_START_ARRAY, NULL);
+}
+
+static int sax_end_array(void *ctx)
+{
+	return sax_event(ctx, SAX_END_ARRAY, NULL);
+}
+
+static const yajl_callbacks sax_callbacks = {
+	.yajl_null        = sax_null,
+	.yajl_boolean     = sax_boolean,
+	.yajl_integer     = sax_integer,
+	.yajl_double      = sax_double,
+	.yajl_number      = sax_number,
+	.yajl_string      = sax_string,
+	.yajl_start_map   = sax_start_map,
+	.yajl_map_key     = sax_map_key,
+	.yajl_end_map     = sax_end_map,
+	.yajl_start_array = sax_start_array,
+	.yajl_end_array   = sax_end_array
+};
+
+static int json_sax(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!spn_isstring(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a string", NULL);
+		return -2;
+	}
+
+	if (!spn_ishashmap(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a hashmap of handlers", NULL);
+		return -3;
+	}
+
+	if (argc >= 3 && !spn_ishashmap(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "3rd argument must be a config object", NULL);
+		return -4;
+	}
+
+	SpnString *strobj = spn_stringvalue(&argv[0]);
+	const unsigned char *str = (const unsigned char *)(strobj->cstr);
+	size_t length = strobj->len;
+	ParserOptions options = default_parser_options();
+
+	if (argc >= 3) {
+		config_parser(&options, argv[2]);
+	}
+
+	if (options.lines) {
+		options.yajl_flags |= yajl_allow_multiple_values;
+	}
+
+	SaxParser sax = {
+		.ctx = ctx,
+		.batch = spn_nilval,
+		.local_keys = { NULL, 0, 0 },
+		.keys = NULL,
+		.local_strings = { NULL, 0, 0 },
+		.strings = NULL,
+		.explicit_null = options.explicit_null,
+		.raw_numbers = options.raw_numbers,
+		.stopped = 0,
+		.error_reported = 0,
+		.error = NULL
+	};
+
+	sax.keys = options.cache_keys ? key_cache_get() : &sax.local_keys;
+	sax.strings = options.dedup_strings ? &sax.local_strings : NULL;
+
+	for (int i = 0; i < SAX_NUM_EVENTS; i++) {
+		SpnValue handler = spn_hashmap_get_strkey(spn_hashmapvalue(&argv[1]), sax_event_names[i]);
+		sax.handlers[i] = spn_isfunc(&handler) ? handler : spn_nilval;
+	}
+
+	// handlers may call YAJL["sax"] again, so each call has its own arena
+	Arena arena = { NULL };
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&arena);
+	yajl_handle hndl = yajl_alloc(&sax_callbacks, &alloc_funcs, &sax);
+	config_handle_flags(hndl, options.yajl_flags);
+
+	int rv = 0;
+	yajl_status status = yajl_parse(hndl, str, length);
+
+	// with 'lines', empty input is no documents, as in parse_lines()
+	if (status == yajl_status_ok && !(options.lines && json_is_blank(str, length))) {
+		status = yajl_complete_parse(hndl);
+	}
+
+	// scalars at the end of the input
+	if (status == yajl_status_ok && !sax_flush(&sax)) {
+		status = yajl_status_client_canceled;
+	}
+
+	if (status != yajl_status_ok && !sax.stopped) {
+		if (sax.error) {
+			const void *args[1] = { sax.error };
+			spn_ctx_runtime_error(ctx, "error parsing JSON: %s", args);
+		} else if (!sax.error_reported) {
+			error_message_to_spn_context(hndl, ctx, str, length);
+		}
+
+		rv = -5;
+	} else {
+		// false if a handler stopped the parse
+		*ret = spn_makebool(!sax.stopped);
+	}
+
+	yajl_free(hndl);
+	arena_destroy(&arena);
+	spn_value_release(&sax.batch);
+	intern_free(&sax.local_keys);
+	intern_free(&sax.local_strings);
+
+	return rv;
+}
+
+/*
+ * Incremental parser
+ */
+
+// A parser object that keeps its YAJL handle and ParserState alive
+// between calls, so that documents can be parsed chunk by chunk.
+// Once finished (or failed) it releases its parser.
+typedef struct StreamParser {
+	SpnObject base;
+	PooledParser *parser;
+	int failed;
+	int in_use; // in feed() or finish(), which may call 'each'
+	InternTable keys; // with 'cache_keys', instead of a thread's key_cache
+} StreamParser;
+
+static void stream_parser_dtor(void *obj)
+{
+	StreamParser *sp = obj;
+
+	if (sp->parser) {
+		parser_release(sp->parser, 0);
+	}
+
+	intern_free(&sp->keys);
+}
+
+static const SpnClass StreamParser_class = {
+	.instsz     = sizeof(StreamParser),
+	.equal      = NULL,
+	.compare    = NULL,
+	.hashfn     = NULL,
+	.destructor = stream_parser_dtor
+};
+
+static StreamParser *stream_parser_arg(SpnValue *arg, SpnContext *ctx)
+{
+	if (!spn_isstrguserinfo(arg) || spn_objvalue(arg)->isa != &StreamParser_class) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a parser object", NULL);
+		return NULL;
+	}
+
+	StreamParser *sp = (StreamParser *)(spn_objvalue(arg));
+
+	if (sp->parser == NULL) {
+		const char *msg = sp->failed ? "parser is in an error state" : "parser has already finished";
+		const void *args[1] = { msg };
+		spn_ctx_runtime_error(ctx, "%s", args);
+		return NULL;
+	}
+
+	// e. g. feed() called from the 'each' function of the same parser
+	if (sp->in_use) {
+		spn_ctx_runtime_error(ctx, "parser is already in use (re-entrant feed or finish)", NULL);
+		return NULL;
+	}
+
+	return sp;
+}
+
+static int json_stream_parser(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc > 1) {
+		spn_ctx_runtime_error(ctx, "expecting 0 or 1 arguments", NULL);
+		return -1;
+	}
+
+	if (argc >= 1 && !spn_ishashmap(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a config object", NULL);
+		return -2;
+	}
+
+	ParserOptions options = default_parser_options();
+
+	if (argc >= 1) {
+		config_parser(&options, argv[0]);
+	}
+
+	StreamParser *sp = spn_object_new(&StreamParser_class);
+	sp->parser = parser_new(&options);
+	sp->failed = 0;
+	sp->in_use = 0;
+	sp->keys = (InternTable) { NULL, 0, 0 };
+
+	// the parser may be fed from any thread, so it doesn't share the
+	// creating thread's key cache, but keeps the keys of its documents
+	if (options.cache_keys) {
+		sp->parser->state.keys = &sp->keys;
+	}
+
+	*ret = spn_makestrguserinfo(sp);
+
+	return 0;
+}
+
+static void stream_parser_fail(StreamParser *sp)
+{
+	parser_release(sp->parser, 0);
+	sp->parser = NULL;
+	sp->failed = 1;
+}
+
+static int json_stream_feed(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
+		return -1;
+	}
+
+	StreamParser *sp = stream_parser_arg(&argv[0], ctx);
+	if (sp == NULL) {
+		return -2;
+	}
+
+	if (!spn_isstring(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a string", NULL);
+		return -3;
+	}
+
+	SpnString *strobj = spn_stringvalue(&argv[1]);
+	const unsigned char *str = (const unsigned char *)(strobj->cstr);
+	sp->in_use = 1;
+	int rv = parser_feed(sp->parser, str, strobj->len, ctx);
+	sp->in_use = 0;
+
+	if (rv != 0) {
+		stream_parser_fail(sp);
+	}
+
+	return rv;
+}
+
+static int json_stream_finish(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting 1 argument", NULL);
+		return -1;
+	}
+
+	StreamParser *sp = stream_parser_arg(&argv[0], ctx);
+	if (sp == NULL) {
+		return -2;
+	}
+
+	sp->in_use = 1;
+	int rv = parser_complete(sp->parser, ret, ctx, NULL, 0);
+	sp->in_use = 0;
+
+	if (rv != 0) {
+		stream_parser_fail(sp);
+	} else {
+		parser_release(sp->parser, 0);
+		sp->parser = NULL;
+	}
+
+	return rv;
+}
+
+/*
+ * Number formatting
+ *
+ * Doubles are printed with the Grisu2 algorithm (Florian Loitsch,
+ * "Printing Floating-Point Numbers Quickly and Accurately with
+ * Integers", 2010), which produces the shortest (in rare cases, nearly
+ * the shortest) digit string that parses back to the same double, using
+ * 64-bit integer arithmetic only. The result goes to yajl_gen_number(),
+ * replacing the slower and longer "%.17g" of yajl_gen_double().
+ */
+
+#define DTOA_BUFFER_SIZE 32
+
+typedef struct DiyFp {
+	uint64_t f;
+	int e;
+} DiyFp;
+
+// Normalized 64-bit approximations of 10^k for k = -348, -340, ..., 340:
+// 10^k ~ grisu_pow10_f[i] * 2^grisu_pow10_e[i]
+static const uint64_t grisu_pow10_f[87] = {
+	UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+	UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+	UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+	UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+	UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+	UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+	UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+	UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+	UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+	UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+	UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+	UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+	UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+	UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+	UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+	UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+	UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+	UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+	UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+	UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+	UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+	UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+	UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+	UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+	UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+	UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+	UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+	UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+	UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const int16_t grisu_pow10_e[87] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t grisu_pow10[20] = {
+	UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+	UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000),
+	UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+	UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000),
+	UINT64_C(1000000000000000), UINT64_C(10000000000000000),
+	UINT64_C(100000000000000000), UINT64_C(1000000000000000000),
+	UINT64_C(10000000000000000000)
+};
+
+#define DIYFP_HIDDEN_BIT (UINT64_C(1) << 52)
+
+static DiyFp diyfp_from_double(double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof bits);
+
+	int biased_e = (int)((bits >> 52) & 0x7FF);
+	uint64_t significand = bits & (DIYFP_HIDDEN_BIT - 1);
+
+	if (biased_e != 0) {
+		return (DiyFp) { significand + DIYFP_HIDDEN_BIT, biased_e - 1075 };
+	}
+
+	return (DiyFp) { significand, -1074 };
+}
+
+static DiyFp diyfp_normalize(DiyFp x)
+{
+	while (!(x.f & (UINT64_C(1) << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+
+	return x;
+}
+
+// The upper 64 bits of the product, rounded
+static DiyFp diyfp_multiply(DiyFp x, DiyFp y)
+{
+	const uint64_t M32 = 0xFFFFFFFF;
+	uint64_t a = x.f >> 32, b = x.f & M32;
+	uint64_t c = y.f >> 32, d = y.f & M32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (UINT64_C(1) << 31);
+
+	return (DiyFp) { ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+}
+
+// The boundaries of the interval of reals that round to 'v',
+// normalized to the same exponent
+static void diyfp_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus)
+{
+	DiyFp pl = { (v.f << 1) + 1, v.e - 1 };
+
+	while (!(pl.f & (DIYFP_HIDDEN_BIT << 1))) {
+		pl.f <<= 1;
+		pl.e--;
+	}
+
+	pl.f <<= 10;
+	pl.e -= 10;
+
+	// the gap below a power of two is half as wide
+	DiyFp mi = v.f == DIYFP_HIDDEN_BIT ? (DiyFp) { (v.f << 2) - 1, v.e - 2 } : (DiyFp) { (v.f << 1) - 1, v.e - 1 };
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+
+	*minus = mi;
+	*plus = pl;
+}
+
+// Picks a cached power 10^-K that brings the binary exponent 'e'
+// into the range [-60, -32]
+static DiyFp grisu_cached_power(int e, int *K)
+{
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int k = (int)(dk);
+
+	if (dk - k > 0.0) {
+		k++;
+	}
+
+	unsigned index = (unsigned)((k >> 3) + 1);
+	*K = -(-348 + (int)(index << 3));
+
+	return (DiyFp) { grisu_pow10_f[index], grisu_pow10_e[index] };
+}
+
+static void grisu_round(
+	char *buffer,
+	int length,
+	uint64_t delta,
+	uint64_t rest,
+	uint64_t ten_kappa,
+	uint64_t wp_w
+)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa
+	    && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buffer[length - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+static int count_decimal_digits32(uint32_t n)
+{
+	int digits = 1;
+
+	while (n >= 10) {
+		n /= 10;
+		digits++;
+	}
+
+	return digits;
+}
+
+static void grisu_digit_gen(DiyFp W, DiyFp Mp, uint64_t delta, char *buffer, int *length, int *K)
+{
+	const DiyFp one = { UINT64_C(1) << -Mp.e, Mp.e };
+	const uint64_t wp_w = Mp.f - W.f;
+	uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+	uint64_t p2 = Mp.f & (one.f - 1);
+	int kappa = count_decimal_digits32(p1);
+
+	*length = 0;
+
+	// integral part
+	while (kappa > 0) {
+		uint32_t pow10 = (uint32_t)(grisu_pow10[kappa - 1]);
+		uint32_t d = p1 / pow10;
+		p1 %= pow10;
+
+		if (d || *length) {
+			buffer[(*length)++] = (char)('0' + d);
+		}
+
+		kappa--;
+
+		uint64_t rest = ((uint64_t)(p1) << -one.e) + p2;
+		if (rest <= delta) {
+			*K += kappa;
+			grisu_round(buffer, *length, delta, rest, grisu_pow10[kappa] << -one.e, wp_w);
+			return;
+		}
+	}
+
+	// fractional part
+	while (1) {
+		p2 *= 10;
+		delta *= 10;
+
+		char d = (char)(p2 >> -one.e);
+		if (d || *length) {
+			buffer[(*length)++] = (char)('0' + d);
+		}
+
+		p2 &= one.f - 1;
+		kappa--;
+
+		if (p2 < delta) {
+			*K += kappa;
+			int index = -kappa;
+			grisu_round(buffer, *length, delta, p2, one.f, wp_w * (index < 20 ? grisu_pow10[index] : 0));
+			return;
+		}
+	}
+}
+
+// Produces the digits of a positive, finite double; the value is
+// 'digits' * 10^K
+static void grisu2(double value, char *digits, int *length, int *K)
+{
+	DiyFp v = diyfp_from_double(value);
+	DiyFp w_m, w_p;
+
+	diyfp_boundaries(v, &w_m, &w_p);
+
+	DiyFp c_mk = grisu_cached_power(w_p.e, K);
+	DiyFp W = diyfp_multiply(diyfp_normalize(v), c_mk);
+	DiyFp Wp = diyfp_multiply(w_p, c_mk);
+	DiyFp Wm = diyfp_multiply(w_m, c_mk);
+
+	Wm.f++;
+	Wp.f--;
+
+	grisu_digit_gen(W, Wp, Wp.f - Wm.f, digits, length, K);
+}
+
+// Lays out 'length' digits (at the start of 'buf') with the decimal
+// exponent 'k' as JSON, always including a fraction or an exponent so
+// that the number reads back as a float. Returns the new length.
+static int format_digits(char *buf, int length, int k)
+{
+	int point = length + k; // position of the decimal point
+
+	if (k >= 0 && point <= 21) {
+		// 1234e7 -> 12340000000.0
+		memset(buf + length, '0', k);
+		buf[point] = '.';
+		buf[point + 1] = '0';
+		return point + 2;
+	}
+
+	if (point > 0 && point <= 21) {
+		// 1234e-2 -> 12.34
+		memmove(buf + point + 1, buf + point, length - point);
+		buf[point] = '.';
+		return length + 1;
+	}
+
+	if (point > -6 && point <= 0) {
+		// 1234e-6 -> 0.001234
+		int offset = 2 - point;
+		memmove(buf + offset, buf, length);
+		buf[0] = '0';
+		buf[1] = '.';
+		memset(buf + 2, '0', offset - 2);
+		return length + offset;
+	}
+
+	// 1234e30 -> 1.234e33
+	int n = 1;
+
+	if (length > 1) {
+		memmove(buf + 2, buf + 1, length - 1);
+		buf[1] = '.';
+		n = length + 1;
+	}
+
+	int exp = point - 1;
+	buf[n++] = 'e';
+
+	if (exp < 0) {
+		buf[n++] = '-';
+		exp = -exp;
+	}
+
+	if (exp >= 100) {
+		buf[n++] = (char)('0' + exp / 100);
+		exp %= 100;
+		buf[n++] = (char)('0' + exp / 10);
+	} else if (exp >= 10) {
+		buf[n++] = (char)('0' + exp / 10);
+	}
+
+	buf[n++] = (char)('0' + exp % 10);
+
+	return n;
+}
+
+// Writes the shortest representation of a finite double to 'buf',
+// which must have room for DTOA_BUFFER_SIZE bytes. Returns its length.
+static size_t format_double(double value, char *buf)
+{
+	char *p = buf;
+
+	if (signbit(value)) {
+		*p++ = '-';
+		value = -value;
+	}
+
+	if (value == 0) {
+		memcpy(p, "0.0", 3);
+		return p - buf + 3;
+	}
+
+	int length, K;
+	grisu2(value, p, &length, &K);
+
+	return p - buf + format_digits(p, length, K);
+}
+
+/*
+ * JSON Generator (serializer) API
+ */
+
+#define RETURN_IF_FAIL(call) \
+	do { \
+		if ((call) != yajl_gen_status_ok) { \
+			const void *args[1] = { #call }; \
+			spn_ctx_runtime_error(ctx, "YAJL error: %s", args); \
+			return -1; \
+		} \
+	} while (0)
+
+static int generate_recursive(yajl_gen gen, SpnValue node, SpnContext *ctx)
+{
+	switch (spn_valtype(&node)) {
+	case SPN_TTAG_NIL: /* this shouldn't really happen */
+		RETURN_IF_FAIL(yajl_gen_null(gen));
+		break;
+	case SPN_TTAG_BOOL:
+		RETURN_IF_FAIL(yajl_gen_bool(gen, spn_boolvalue(&node)));
+		break;
+	case SPN_TTAG_NUMBER:
+		if (spn_isint(&node)) {
+			RETURN_IF_FAIL(yajl_gen_integer(gen, spn_intvalue(&node)));
+		} else {
+			double num = spn_floatvalue(&node);
+
+			// YAJL rejects NaN and infinities
+			if (!isfinite(num)) {
+				RETURN_IF_FAIL(yajl_gen_double(gen, num));
+			}
+
+			char buf[DTOA_BUFFER_SIZE];
+			size_t length = format_double(num, buf);
+			RETURN_IF_FAIL(yajl_gen_number(gen, buf, length));
+		}
+		break;
+	case SPN_TTAG_STRING: {
+		SpnString *strobj = spn_stringvalue(&node);
+		const unsigned char *str = (const unsigned char *)(strobj->cstr);
+		size_t length = strobj->len;
+		RETURN_IF_FAIL(yajl_gen_string(gen, str, length));
+		break;
+	}
+	case SPN_TTAG_ARRAY: {
+		RETURN_IF_FAIL(yajl_gen_array_open(gen));
+
+		SpnArray *array = spn_arrayvalue(&node);
+		size_t n = spn_array_count(array);
+
+		for (size_t i = 0; i < n; i++) {
+			SpnValue elem = spn_array_get(array, i);
+			int error = generate_recursive(gen, elem, ctx);
+			if (error) {
+				return -1;
+			}
+		}
+
+		RETURN_IF_FAIL(yajl_gen_array_close(gen));
+		break;
+	}
+	case SPN_TTAG_HASHMAP: {
+		RETURN_IF_FAIL(yajl_gen_map_open(gen));
+
+		SpnHashMap *hm = spn_hashmapvalue(&node);
+		SpnValue key, val;
+		size_t cursor = 0;
+
+		while ((cursor = spn_hashmap_next(hm, cursor, &key, &val)) != 0) {
+			int error;
+
+			error = generate_recursive(gen, key, ctx);
+			if (error) {
+				return -1;
+			}
+
+			error = generate_recursive(gen, val, ctx);
+			if (error) {
+				return -1;
+			}
+		}
+
+		RETURN_IF_FAIL(yajl_gen_map_close(gen));
+		break;
+	}
+	case SPN_TTAG_USERINFO: {
+		const BigNumber *big = big_number_value(&node);
+
+		if (spn_value_equal(&node, &null_value)) {
+			RETURN_IF_FAIL(yajl_gen_null(gen));
+		} else if (big) {
+			RETURN_IF_FAIL(yajl_gen_number(gen, big->digits, big->length));
+		} else {
+			spn_ctx_runtime_error(ctx, "found non-serializable value", NULL);
+			return -1;
+		}
+		break;
+	}
+	default:
+		spn_ctx_runtime_error(ctx, "found value of unknown type", NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+#undef RETURN_IF_FAIL
+
+// Generator configuration. Generators are pooled per distinct set of
+// options; 'indent' points into the caller's config object and is only
+// valid for the duration of the call (pooled generators copy it).
+#define GEN_MAX_INDENT 15
+
+typedef struct GenOptions {
+	int beautify;
+	int escape_slash;
+	const char *indent;
+} GenOptions;
+
+static GenOptions default_gen_options()
+{
+	return (GenOptions) { .beautify = 0, .escape_slash = 0, .indent = NULL };
+}
+
+static void gen_set_string_option(
+	const char **opt,
+	SpnHashMap *config,
+	const char *name
+)
+{
+	SpnValue optval = spn_hashmap_get_strkey(config, name);
+	if (spn_isstring(&optval)) {
+		SpnString *str = spn_stringvalue(&optval);
+		*opt = str->cstr;
+	}
+}
+
+static void config_gen(GenOptions *options, SpnValue config_obj)
+{
+	assert(spn_ishashmap(&config_obj));
+	SpnHashMap *config = spn_hashmapvalue(&config_obj);
+
+	// Generate indented ('beautified') output
+	set_bool_option(&options->beautify, config, "beautify");
+
+	// When beautifying, use this string to indent.
+	gen_set_string_option(&options->indent, config, "indent");
+
+	// Escape slash ('/') [for use with HTML]
+	set_bool_option(&options->escape_slash, config, "escape_slash");
+}
+
+static int gen_options_equal(const GenOptions *a, const GenOptions *b)
+{
+	if (a->beautify != b->beautify || a->escape_slash != b->escape_slash) {
+		return 0;
+	}
+
+	if (a->indent == NULL || b->indent == NULL) {
+		return a->indent == b->indent;
+	}
+
+	return strcmp(a->indent, b->indent) == 0;
+}
+
+// Applies the options to a YAJL generator. 'indent' must remain
+// valid for as long as the generator is used.
+static void config_gen_handle(yajl_gen gen, const GenOptions *options)
+{
+	yajl_gen_config(gen, yajl_gen_beautify, options->beautify);
+	yajl_gen_config(gen, yajl_gen_escape_solidus, options->escape_slash);
+
+	if (options->indent) {
+		yajl_gen_config(gen, yajl_gen_indent_string, options->indent);
+	}
+}
+
+// Output buffer filled through yajl_gen_print_callback. Its memory comes
+// from malloc() so that it can be handed over to the resulting string
+// as-is, without copying the (potentially huge) generated text.
+#define OUTBUF_MIN_CAPACITY 256
+
+typedef struct OutBuf {
+	char *data;
+	size_t length;
+	size_t capacity;
+	int failed; // out of memory
+} OutBuf;
+
+static int outbuf_reserve(OutBuf *out, size_t capacity)
+{
+	if (capacity <= out->capacity) {
+		return 0;
+	}
+
+	char *data = realloc(out->data, capacity);
+	if (data == NULL) {
+		out->failed = 1;
+		return -1;
+	}
+
+	out->data = data;
+	out->capacity = capacity;
+
+	return 0;
+}
+
+static void outbuf_print(void *ctx, const char *str, size_t len)
+{
+	OutBuf *out = ctx;
+
+	if (out->failed) {
+		return;
+	}
+
+	// always leave room for the terminating NUL byte
+	if (out->capacity - out->length <= len) {
+		size_t capacity = out->capacity ? 2 * out->capacity : OUTBUF_MIN_CAPACITY;
+
+		if (capacity <= out->length + len) {
+			capacity = out->length + len + 1;
+		}
+
+		if (outbuf_reserve(out, capacity) != 0) {
+			return;
+		}
+	}
+
+	memcpy(out->data + out->length, str, len);
+	out->length += len;
+}
+
+// Transfers ownership of the buffer to a new string and empties 'out'
+static SpnValue outbuf_to_string(OutBuf *out)
+{
+	char *data = out->data;
+	size_t length = out->length;
+
+	if (data == NULL) {
+		data = malloc(1);
+	} else if (out->capacity - length > length / 4 + OUTBUF_MIN_CAPACITY) {
+		// give back excess capacity; shrinking is done in place
+		char *shrunk = realloc(data, length + 1);
+		data = shrunk ? shrunk : data;
+	}
+
+	data[length] = 0;
+
+	out->data = NULL;
+	out->length = 0;
+	out->capacity = 0;
+
+	return spn_makestring_nocopy_len(data, length, 1);
+}
+
+static void outbuf_free(OutBuf *out)
+{
+	free(out->data);
+	out->data = NULL;
+	out->length = 0;
+	out->capacity = 0;
+	out->failed = 0;
+}
+
+// Pool of generators. yajl_gen_reset() makes a generator reusable. Output
+// goes to the pooled generator's OutBuf, which is preallocated to the size
+// of its previous output, so similarly sized values don't regrow it.
+// Neither the preallocation nor a buffer kept in the pool (e. g. after an
+// error) exceeds GEN_MAX_RETAINED bytes.
+#define GEN_POOL_SIZE 4
+#define GEN_MAX_RETAINED (4 * 1024 * 1024)
+
+typedef struct PooledGen {
+	yajl_gen gen;
+	GenOptions options;
+	char indent[GEN_MAX_INDENT + 1];
+	int in_use;
+	int pooled;
+	OutBuf out;
+	size_t last_length; // size hint for the next output buffer
+	Arena arena;
+} PooledGen;
+
+static THREAD_LOCAL PooledGen gen_pool[GEN_POOL_SIZE];
+
+static void gen_create(PooledGen *pgen, const GenOptions *options)
+{
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&pgen->arena);
+	pgen->gen = yajl_gen_alloc(&alloc_funcs);
+	pgen->options = *options;
+
+	// YAJL keeps a pointer to the indent string; pooled generators
+	// outlive the config object, so they need their own copy.
+	if (options->indent && pgen->pooled) {
+		strcpy(pgen->indent, options->indent);
+		pgen->options.indent = pgen->indent;
+	}
+
+	yajl_gen_config(pgen->gen, yajl_gen_print_callback, outbuf_print, &pgen->out);
+	config_gen_handle(pgen->gen, &pgen->options);
+}
+
+static void gen_destroy(PooledGen *pgen)
+{
+	if (pgen->gen) {
+		yajl_gen_free(pgen->gen);
+		pgen->gen = NULL;
+	}
+
+	arena_reset(&pgen->arena);
+}
+
+static PooledGen *gen_acquire(const GenOptions *options)
+{
+	PooledGen *pgen = NULL;
+	int poolable = options->indent == NULL || strlen(options->indent) <= GEN_MAX_INDENT;
+	thread_cache_register();
+
+	for (size_t i = 0; i < GEN_POOL_SIZE && poolable && pgen == NULL; i++) {
+		PooledGen *p = &gen_pool[i];
+		if (!p->in_use && p->gen && gen_options_equal(&p->options, options)) {
+			pgen = p;
+		}
+	}
+
+	for (size_t i = 0; i < GEN_POOL_SIZE && poolable && pgen == NULL; i++) {
+		if (!gen_pool[i].in_use && gen_pool[i].gen == NULL) {
+			pgen = &gen_pool[i];
+		}
+	}
+
+	for (size_t i = 0; i < GEN_POOL_SIZE && poolable && pgen == NULL; i++) {
+		if (!gen_pool[i].in_use) {
+			pgen = &gen_pool[i];
+			gen_destroy(pgen);
+		}
+	}
+
+	// busy pool or unusual options: use a private generator
+	if (pgen == NULL) {
+		pgen = calloc(1, sizeof *pgen);
+	} else {
+		pgen->pooled = 1;
+	}
+
+	if (pgen->gen == NULL) {
+		gen_create(pgen, options);
+	}
+
+	pgen->in_use = 1;
+
+	// the hint is only an optimization, running out of memory isn't
+	// an error until the output is actually generated
+	size_t hint = pgen->last_length < GEN_MAX_RETAINED ? pgen->last_length : GEN_MAX_RETAINED;
+	if (outbuf_reserve(&pgen->out, hint + 1) != 0) {
+		pgen->out.failed = 0;
+	}
+
+	return pgen;
+}
+
+static void gen_release(PooledGen *pgen)
+{
+	if (pgen->pooled) {
+		yajl_gen_reset(pgen->gen, NULL);
+
+		if (pgen->out.capacity > GEN_MAX_RETAINED + 1) {
+			outbuf_free(&pgen->out);
+		} else {
+			pgen->out.length = 0;
+			pgen->out.failed = 0;
+		}
+
+		pgen->in_use = 0;
+	} else {
+		gen_destroy(pgen);
+		outbuf_free(&pgen->out);
+		arena_destroy(&pgen->arena);
+		free(pgen);
+	}
+}
+
+// Releases the caches of an exiting thread (see thread_cache_register())
+static void thread_cache_free(void *unused)
+{
+	(void)(unused);
+
+	for (size_t i = 0; i < PARSER_POOL_SIZE; i++) {
+		PooledParser *parser = &parser_pool[i];
+
+		if (parser->pooled) {
+			parser_destroy_handle(parser);
+			state_free(&parser->state);
+			arena_destroy(&parser->arena);
+		}
+
+		memset(parser, 0, sizeof *parser);
+	}
+
+	for (size_t i = 0; i < GEN_POOL_SIZE; i++) {
+		PooledGen *pgen = &gen_pool[i];
+
+		gen_destroy(pgen);
+		outbuf_free(&pgen->out);
+		arena_destroy(&pgen->arena);
+		memset(pgen, 0, sizeof *pgen);
+	}
+
+	intern_free(&key_cache);
+	arena_destroy(&tape_arena);
+	arena_destroy(&validator_arena);
+	arena_destroy(&extract_arena);
+
+	thread_cache_used = 0;
+}
+
+// Runs when the module is unloaded. The key's destructor would be gone
+// by the time other threads exit, so the key is deleted; their caches
+// are leaked instead. The unloading thread's own caches are freed.
+#ifdef __GNUC__
+__attribute__((destructor))
+#endif
+static void thread_cache_unload(void)
+{
+	if (!thread_cache_key_created) {
+		return;
+	}
+
+	if (thread_cache_used) {
+		thread_cache_free(NULL);
+	}
+
+	pthread_key_delete(thread_cache_key);
+	thread_cache_key_created = 0;
+}
+
+static int json_generate(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	if (argc < 1 || argc > 2) {
+		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+		return -1;
+	}
+
+	if (argc >= 2 && !spn_ishashmap(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a config object", NULL);
+		return -2;
+	}
+
+	GenOptions options = default_gen_options();
+
+	if (argc >= 2) {
+		config_gen(&options, argv[1]);
+	}
+
+	PooledGen *pgen = gen_acquire(&options);
+	yajl_gen gen = pgen->gen;
+
+	int error = generate_recursive(gen, argv[0], ctx);
+
+	if (error == 0) {
+		if (pgen->out.failed) {
+			spn_ctx_runtime_error(ctx, "out of memory generating JSON string", NULL);
+			error = -3;
+		} else {
+			pgen->last_length = pgen->out.length;
+			*ret = outbuf_to_string(&pgen->out);
+		}
+	}
+
+	gen_release(pgen);
+
+	return error;
+}
+
+/*
+ * Generating to files
+ */
+
+// Output goes through a fixed-size buffer straight to a file descriptor,
+// so memory use doesn't depend on the size of the generated text.
+#define WRITE_BUFFER_SIZE (64 * 1024)
+
+typedef struct FileWriter {
+	int fd;
+	char *buf;
+	size_t length;
+	long long written; // total number of bytes
+	int error; // errno of the first failed write
+} FileWriter;
+
+static void filewriter_write(FileWriter *fw, const char *data, size_t length)
+{
+	while (length > 0 && fw->error == 0) {
+		ssize_t n = write(fw->fd, data, length);
+
+		if (n < 0) {
+			if (errno != EINTR) {
+				fw->error = errno;
+			}
+
+			continue;
 		}
 
-		RETURN_IF_FAIL(yajl_gen_map_close(gen));
-		break;
+		data += n;
+		length -= n;
+		fw->written += n;
 	}
-	case SPN_TTAG_USERINFO:
-		if (spn_value_equal(&node, &null_value)) {
-			RETURN_IF_FAIL(yajl_gen_null(gen));
+}
+
+static void filewriter_flush(FileWriter *fw)
+{
+	filewriter_write(fw, fw->buf, fw->length);
+	fw->length = 0;
+}
+
+static void filewriter_print(void *ctx, const char *str, size_t len)
+{
+	FileWriter *fw = ctx;
+
+	if (fw->length + len > WRITE_BUFFER_SIZE) {
+		filewriter_flush(fw);
+	}
+
+	// pieces that don't fit into the buffer anyway are written directly
+	if (len >= WRITE_BUFFER_SIZE) {
+		filewriter_write(fw, str, len);
+	} else {
+		memcpy(fw->buf + fw->length, str, len);
+		fw->length += len;
+	}
+}
+
+// Opens the file that 'path' is generated into. A regular file is only
+// replaced once all of the output has been written: the output goes to a
+// new file next to it, whose name is stored in '*tmppath', and which is
+// renamed to '*destpath' at the end. That is 'path' itself or, if 'path'
+// is a symbolic link, the file it points to. The new file gets the owner
+// and mode of the old one. Files which can't be replaced like this are
+// written directly: devices, pipes, files with more than one (hard) link,
+// dangling symbolic links, and files whose owner can't be kept.
+static int generate_open_file(const char *path, char **tmppath, char **destpath)
+{
+	struct stat st;
+	char *dest = NULL;
+
+	*tmppath = NULL;
+	*destpath = NULL;
+
+	int exists = lstat(path, &st) == 0;
+
+	if (exists && S_ISLNK(st.st_mode)) {
+		dest = realpath(path, NULL);
+
+		if (dest == NULL) {
+			return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		}
+
+		exists = stat(dest, &st) == 0;
+	}
+
+	const char *target = dest ? dest : path;
+
+	if (exists && (!S_ISREG(st.st_mode) || st.st_nlink > 1)) {
+		free(dest);
+		return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+
+	size_t size = strlen(target) + 32;
+	char *tmp = malloc(size);
+
+	if (tmp == NULL) {
+		free(dest);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// O_EXCL, so that concurrent calls don't share a temporary file
+	for (int attempt = 0; attempt < 100; attempt++) {
+		snprintf(tmp, size, "%s.%ld-%d.tmp", target, (long)(getpid()), attempt);
+
+		// only the owner may see the output until it has the old mode
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, exists ? 0600 : 0666);
+
+		if (fd < 0 && errno == EEXIST) {
+			continue;
+		}
+
+		if (fd < 0) {
+			break;
+		}
+
+		// chown() clears the set-user-ID bit, so the mode comes second
+		if (exists && (fchown(fd, st.st_uid, st.st_gid) != 0 || fchmod(fd, st.st_mode & 07777) != 0)) {
+			close(fd);
+			unlink(tmp);
+			free(tmp);
+			free(dest);
+			return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		}
+
+		*tmppath = tmp;
+		*destpath = dest;
+		return fd;
+	}
+
+	int saved_errno = errno;
+	free(tmp);
+	free(dest);
+	errno = saved_errno;
+
+	return -1;
+}
+
+static int json_generate_to_file(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+{
+	if (argc < 2 || argc > 3) {
+		spn_ctx_runtime_error(ctx, "expecting 2 or 3 arguments", NULL);
+		return -1;
+	}
+
+	if (!spn_isstring(&argv[1]) && !spn_isint(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a file path or descriptor", NULL);
+		return -2;
+	}
+
+	if (argc >= 3 && !spn_ishashmap(&argv[2])) {
+		spn_ctx_runtime_error(ctx, "3rd argument must be a config object", NULL);
+		return -3;
+	}
+
+	GenOptions options = default_gen_options();
+
+	if (argc >= 3) {
+		config_gen(&options, argv[2]);
+	}
+
+	FileWriter fw = {
+		.fd = -1,
+		.buf = malloc(WRITE_BUFFER_SIZE),
+		.length = 0,
+		.written = 0,
+		.error = 0
+	};
+
+	if (fw.buf == NULL) {
+		spn_ctx_runtime_error(ctx, "out of memory generating JSON", NULL);
+		return -4;
+	}
+
+	const char *path = NULL; // NULL for file descriptors
+	char *tmppath = NULL;
+	char *destpath = NULL;
+
+	if (spn_isstring(&argv[1])) {
+		path = spn_stringvalue(&argv[1])->cstr;
+		fw.fd = generate_open_file(path, &tmppath, &destpath);
+
+		if (fw.fd < 0) {
+			const void *args[2] = { path, strerror(errno) };
+			spn_ctx_runtime_error(ctx, "cannot open file '%s': %s", args);
+			free(fw.buf);
+			return -4;
+		}
+	} else {
+		// descriptors are borrowed from the caller and left open
+		fw.fd = (int)(spn_intvalue(&argv[1]));
+	}
+
+	Arena arena = { NULL };
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&arena);
+	yajl_gen gen = yajl_gen_alloc(&alloc_funcs);
+	config_gen_handle(gen, &options);
+	yajl_gen_config(gen, yajl_gen_print_callback, filewriter_print, &fw);
+
+	int error = generate_recursive(gen, argv[0], ctx);
+	filewriter_flush(&fw);
+
+	if (path && close(fw.fd) != 0 && fw.error == 0) {
+		fw.error = errno;
+	}
+
+	// on failure, the original file is left as it was
+	if (tmppath) {
+		const char *dest = destpath ? destpath : path;
+
+		if (error == 0 && fw.error == 0 && rename(tmppath, dest) != 0) {
+			fw.error = errno;
+		}
+
+		if (error != 0 || fw.error != 0) {
+			unlink(tmppath);
+		}
+
+		free(tmppath);
+		free(destpath);
+	}
+
+	if (error == 0) {
+		if (fw.error && path) {
+			const void *args[2] = { path, strerror(fw.error) };
+			spn_ctx_runtime_error(ctx, "cannot write file '%s': %s", args);
+			error = -5;
+		} else if (fw.error) {
+			const void *args[1] = { strerror(fw.error) };
+			spn_ctx_runtime_error(ctx, "cannot write to file descriptor: %s", args);
+			error = -5;
 		} else {
-			spn_ctx_runtime_error(ctx, "found non-serializable value", NULL);
-			return -1;
+			*ret = spn_makeint(fw.written);
 		}
+	}
+
+	yajl_gen_free(gen);
+	arena_destroy(&arena);
+	free(fw.buf);
+
+	return error;
+}
+
+/*
+ * Incremental generator
+ *
+ * A generator object emits JSON piece by piece, so that the value to
+ * be serialized doesn't need to exist as a whole. flush() takes the
+ * text generated so far.
+ */
+
+// What the innermost open container expects next
+enum {
+	STREAM_GEN_ARRAY,     // a value
+	STREAM_GEN_MAP_KEY,   // a key, or the end of the object
+	STREAM_GEN_MAP_VALUE  // the value of the last key
+};
+
+typedef struct StreamGen {
+	SpnObject base;
+	yajl_gen gen;
+	char *indent; // YAJL keeps a pointer to it
+	OutBuf out;
+	unsigned char *open; // STREAM_GEN_* state of each open container
+	size_t depth;
+	size_t capacity;
+	Arena arena;
+	int failed; // YAJL's output and 'open' may no longer agree
+} StreamGen;
+
+static void stream_gen_dtor(void *obj)
+{
+	StreamGen *sg = obj;
+
+	yajl_gen_free(sg->gen);
+	arena_destroy(&sg->arena);
+	outbuf_free(&sg->out);
+	free(sg->indent);
+	free(sg->open);
+}
+
+static const SpnClass StreamGen_class = {
+	.instsz     = sizeof(StreamGen),
+	.equal      = NULL,
+	.compare    = NULL,
+	.hashfn     = NULL,
+	.destructor = stream_gen_dtor
+};
+
+static StreamGen *stream_gen_arg(SpnValue *arg, SpnContext *ctx)
+{
+	if (!spn_isstrguserinfo(arg) || spn_objvalue(arg)->isa != &StreamGen_class) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a generator object", NULL);
+		return NULL;
+	}
+
+	StreamGen *sg = (StreamGen *)(spn_objvalue(arg));
+
+	if (sg->failed) {
+		spn_ctx_runtime_error(ctx, "generator is in an error state", NULL);
+		return NULL;
+	}
+
+	return sg;
+}
+
+// Reports a failed YAJL call. Part of a value may have been written by
+// then, so the generator can't be used any further.
+static int stream_gen_check(StreamGen *sg, yajl_gen_status status, SpnContext *ctx)
+{
+	const char *msg;
+
+	switch (status) {
+	case yajl_gen_status_ok:
+		return 0;
+	case yajl_gen_keys_must_be_strings:
+		msg = "expecting an object key";
+		break;
+	case yajl_max_depth_exceeded:
+		msg = "maximum nesting depth exceeded";
+		break;
+	case yajl_gen_in_error_state:
+		msg = "generator is in an error state";
+		break;
+	case yajl_gen_generation_complete:
+		msg = "a complete value has already been generated";
+		break;
+	case yajl_gen_invalid_number:
+		msg = "invalid number";
+		break;
+	case yajl_gen_invalid_string:
+		msg = "invalid UTF-8 string";
 		break;
 	default:
-		spn_ctx_runtime_error(ctx, "found value of unknown type", NULL);
+		msg = "unknown error";
+	}
+
+	sg->failed = 1;
+
+	const void *args[1] = { msg };
+	spn_ctx_runtime_error(ctx, "YAJL error: %s", args);
+
+	return -3;
+}
+
+static int json_stream_gen(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc > 1) {
+		spn_ctx_runtime_error(ctx, "expecting 0 or 1 arguments", NULL);
 		return -1;
 	}
 
+	if (argc >= 1 && !spn_ishashmap(&argv[0])) {
+		spn_ctx_runtime_error(ctx, "1st argument must be a config object", NULL);
+		return -2;
+	}
+
+	GenOptions options = default_gen_options();
+
+	if (argc >= 1) {
+		config_gen(&options, argv[0]);
+	}
+
+	StreamGen *sg = spn_object_new(&StreamGen_class);
+	sg->indent = NULL;
+	sg->out = (OutBuf) { NULL, 0, 0, 0 };
+	sg->open = NULL;
+	sg->depth = 0;
+	sg->capacity = 0;
+	sg->arena = (Arena) { NULL };
+	sg->failed = 0;
+
+	if (options.indent) {
+		sg->indent = malloc(strlen(options.indent) + 1);
+		strcpy(sg->indent, options.indent);
+		options.indent = sg->indent;
+	}
+
+	yajl_alloc_funcs alloc_funcs = arena_alloc_funcs(&sg->arena);
+	sg->gen = yajl_gen_alloc(&alloc_funcs);
+	config_gen_handle(sg->gen, &options);
+	yajl_gen_config(sg->gen, yajl_gen_print_callback, outbuf_print, &sg->out);
+
+	*ret = spn_makestrguserinfo(sg);
+
 	return 0;
 }
 
-#undef RETURN_IF_FAIL
+// Checks that a value may be generated at the current position, i. e.
+// not where an object key is expected
+static int stream_gen_check_value(StreamGen *sg, SpnContext *ctx)
+{
+	if (sg->depth > 0 && sg->open[sg->depth - 1] == STREAM_GEN_MAP_KEY) {
+		spn_ctx_runtime_error(ctx, "expecting an object key, not a value", NULL);
+		return -3;
+	}
 
-static void gen_set_bool_option(
-	yajl_gen gen,
-	yajl_gen_option opt,
-	SpnHashMap *config,
-	const char *name
-)
+	return 0;
+}
+
+// After a complete value, an object expects the next key again
+static void stream_gen_value_done(StreamGen *sg)
 {
-	SpnValue optval = spn_hashmap_get_strkey(config, name);
-	if (spn_isbool(&optval)) {
-		yajl_gen_config(gen, opt, spn_boolvalue(&optval));
+	if (sg->depth > 0 && sg->open[sg->depth - 1] == STREAM_GEN_MAP_VALUE) {
+		sg->open[sg->depth - 1] = STREAM_GEN_MAP_KEY;
 	}
 }
 
-static void gen_set_string_option(
-	yajl_gen gen,
-	yajl_gen_option opt,
-	SpnHashMap *config,
-	const char *name
-)
+// Common part of open_map() and open_array()
+static int stream_gen_open(SpnValue *ret, int argc, SpnValue argv[], SpnContext *ctx, int is_map)
 {
-	SpnValue optval = spn_hashmap_get_strkey(config, name);
-	if (spn_isstring(&optval)) {
-		SpnString *str = spn_stringvalue(&optval);
-		yajl_gen_config(gen, opt, str->cstr);
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting 1 argument", NULL);
+		return -1;
+	}
+
+	StreamGen *sg = stream_gen_arg(&argv[0], ctx);
+	if (sg == NULL) {
+		return -2;
+	}
+
+	if (stream_gen_check_value(sg, ctx) != 0) {
+		return -3;
+	}
+
+	if (sg->depth == sg->capacity) {
+		size_t capacity = sg->capacity ? 2 * sg->capacity : STATE_STACK_INITIAL_CAPACITY;
+		unsigned char *open = realloc(sg->open, capacity);
+
+		if (open == NULL) {
+			spn_ctx_runtime_error(ctx, "out of memory generating JSON", NULL);
+			return -3;
+		}
+
+		sg->open = open;
+		sg->capacity = capacity;
+	}
+
+	yajl_gen_status status = is_map ? yajl_gen_map_open(sg->gen) : yajl_gen_array_open(sg->gen);
+	if (status != yajl_gen_status_ok) {
+		return stream_gen_check(sg, status, ctx);
 	}
+
+	stream_gen_value_done(sg);
+	sg->open[sg->depth++] = is_map ? STREAM_GEN_MAP_KEY : STREAM_GEN_ARRAY;
+
+	return 0;
 }
 
-static void config_gen(yajl_gen gen, SpnValue config_obj)
+static int json_stream_gen_open_map(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
 {
-	assert(spn_ishashmap(&config_obj));
-	SpnHashMap *config = spn_hashmapvalue(&config_obj);
+	return stream_gen_open(ret, argc, argv, ctx, 1);
+}
 
-	// Generate indented ('beautified') output
-	gen_set_bool_option(gen, yajl_gen_beautify, config, "beautify");
+static int json_stream_gen_open_array(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	return stream_gen_open(ret, argc, argv, ctx, 0);
+}
 
-	// When beautifying, use this string to indent.
-	gen_set_string_option(gen, yajl_gen_indent_string, config, "indent");
+// Closes the innermost open object or array
+static int json_stream_gen_close(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting 1 argument", NULL);
+		return -1;
+	}
 
-	// Escape slash ('/') [for use with HTML]
-	gen_set_bool_option(gen, yajl_gen_escape_solidus, config, "escape_slash");
+	StreamGen *sg = stream_gen_arg(&argv[0], ctx);
+	if (sg == NULL) {
+		return -2;
+	}
+
+	if (sg->depth == 0) {
+		spn_ctx_runtime_error(ctx, "no object or array to close", NULL);
+		return -3;
+	}
+
+	int kind = sg->open[sg->depth - 1];
+
+	if (kind == STREAM_GEN_MAP_VALUE) {
+		spn_ctx_runtime_error(ctx, "expecting a value for the last object key", NULL);
+		return -3;
+	}
+
+	yajl_gen_status status = kind == STREAM_GEN_ARRAY ? yajl_gen_array_close(sg->gen) : yajl_gen_map_close(sg->gen);
+
+	if (status == yajl_gen_status_ok) {
+		sg->depth--;
+	}
+
+	return stream_gen_check(sg, status, ctx);
 }
 
-static int json_generate(SpnValue *ret, int argc, SpnValue *argv, void *ctx)
+static int json_stream_gen_key(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
 {
-	if (argc < 1 || argc > 2) {
-		spn_ctx_runtime_error(ctx, "expecting 1 or 2 arguments", NULL);
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
 		return -1;
 	}
 
-	if (argc >= 2 && !spn_ishashmap(&argv[1])) {
-		spn_ctx_runtime_error(ctx, "2nd argument must be a config object", NULL);
+	StreamGen *sg = stream_gen_arg(&argv[0], ctx);
+	if (sg == NULL) {
 		return -2;
 	}
 
-	yajl_gen gen = yajl_gen_alloc(NULL);
+	if (!spn_isstring(&argv[1])) {
+		spn_ctx_runtime_error(ctx, "2nd argument must be a string", NULL);
+		return -3;
+	}
 
-	if (argc >= 2) {
-		config_gen(gen, argv[1]);
+	if (sg->depth == 0 || sg->open[sg->depth - 1] == STREAM_GEN_ARRAY) {
+		spn_ctx_runtime_error(ctx, "keys can only be generated within objects", NULL);
+		return -3;
 	}
 
-	int error = generate_recursive(gen, argv[0], ctx);
+	if (sg->open[sg->depth - 1] == STREAM_GEN_MAP_VALUE) {
+		spn_ctx_runtime_error(ctx, "expecting a value for the last object key, not another key", NULL);
+		return -3;
+	}
 
-	if (error == 0) {
-		const unsigned char *str;
-		size_t length;
-		yajl_gen_status status = yajl_gen_get_buf(gen, &str, &length);
+	SpnString *strobj = spn_stringvalue(&argv[1]);
+	const unsigned char *str = (const unsigned char *)(strobj->cstr);
 
-		if (status == yajl_gen_status_ok) {
-			*ret = spn_makestring_len((const char *)str, length);
-		} else {
-			spn_ctx_runtime_error(ctx, "error generating JSON string", NULL);
-			error = -3;
-		}
+	yajl_gen_status status = yajl_gen_string(sg->gen, str, strobj->len);
+	if (status == yajl_gen_status_ok) {
+		sg->open[sg->depth - 1] = STREAM_GEN_MAP_VALUE;
 	}
 
-	yajl_gen_free(gen);
+	return stream_gen_check(sg, status, ctx);
+}
 
-	return error;
+// Generates a complete value (of any kind) at the current position
+static int json_stream_gen_value(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc != 2) {
+		spn_ctx_runtime_error(ctx, "expecting 2 arguments", NULL);
+		return -1;
+	}
+
+	StreamGen *sg = stream_gen_arg(&argv[0], ctx);
+	if (sg == NULL) {
+		return -2;
+	}
+
+	if (stream_gen_check_value(sg, ctx) != 0) {
+		return -3;
+	}
+
+	int rv = generate_recursive(sg->gen, argv[1], ctx);
+	if (rv == 0) {
+		stream_gen_value_done(sg);
+	} else {
+		sg->failed = 1;
+	}
+
+	return rv;
+}
+
+// Returns the text generated since the last flush
+static int json_stream_gen_flush(SpnValue *ret, int argc, SpnValue argv[], void *ctx)
+{
+	if (argc != 1) {
+		spn_ctx_runtime_error(ctx, "expecting 1 argument", NULL);
+		return -1;
+	}
+
+	StreamGen *sg = stream_gen_arg(&argv[0], ctx);
+	if (sg == NULL) {
+		return -2;
+	}
+
+	if (sg->out.failed) {
+		spn_ctx_runtime_error(ctx, "out of memory generating JSON string", NULL);
+		return -3;
+	}
+
+	*ret = outbuf_to_string(&sg->out);
+
+	return 0;
 }
 
 // The module initializer
@@ -473,8 +6634,30 @@ SPN_LIB_OPEN_FUNC(ctx)
 	SpnHashMap *hm = spn_hashmapvalue(&module);
 
 	const SpnExtFunc F[] = {
-		{ "parse",    json_parse    },
-		{ "generate", json_generate }
+		{ "parse",            json_parse                 },
+		{ "generate",         json_generate              },
+		{ "generate_to_file", json_generate_to_file      },
+		{ "parse_file",       json_parse_file            },
+		{ "parse_lines",      json_parse_lines           },
+		{ "validate",         json_validate              },
+		{ "extract",          json_extract               },
+		{ "sax",              json_sax                   },
+		{ "get",              json_get                   },
+		{ "parse_tape",       json_parse_tape            },
+		{ "length",           json_tape_length           },
+		{ "keys",             json_tape_keys             },
+		{ "iterate",          json_tape_iterate          },
+		{ "digits",           json_number_digits         },
+		{ "parser",           json_stream_parser         },
+		{ "feed",             json_stream_feed           },
+		{ "finish",           json_stream_finish         },
+		{ "generator",        json_stream_gen            },
+		{ "open_map",         json_stream_gen_open_map   },
+		{ "open_array",       json_stream_gen_open_array },
+		{ "gen_key",          json_stream_gen_key        },
+		{ "gen_value",        json_stream_gen_value      },
+		{ "gen_close",        json_stream_gen_close      },
+		{ "gen_flush",        json_stream_gen_flush      }
 	};
 
 	const SpnExtValue C[] = {